@@ -1,44 +1,269 @@
 #include "crafting_recipe.h"
+#include "core/object/worker_thread_pool.h"
 
 void CraftingRecipe::_bind_methods() {
     ClassDB::bind_static_method("CraftingRecipe", D_METHOD("all_craftable", "inventory"), &CraftingRecipe::all_craftable);
-    ClassDB::bind_static_method("CraftingRecipe", D_METHOD("register", "recipe"), &CraftingRecipe::register_recipe);
+    ClassDB::bind_static_method("CraftingRecipe", D_METHOD("all_craftable_batch", "inventories"), &CraftingRecipe::all_craftable_batch);
+    ClassDB::bind_static_method("CraftingRecipe", D_METHOD("plan", "inventory", "id", "count"), &CraftingRecipe::plan);
+    ClassDB::bind_static_method("CraftingRecipe", D_METHOD("register", "recipe", "id"), &CraftingRecipe::register_recipe, DEFVAL(StringName()));
+    ClassDB::bind_static_method("CraftingRecipe", D_METHOD("unregister", "id"), &CraftingRecipe::unregister_recipe);
+    ClassDB::bind_static_method("CraftingRecipe", D_METHOD("unregister_all"), &CraftingRecipe::unregister_all);
+    ClassDB::bind_static_method("CraftingRecipe", D_METHOD("get_by_id", "id"), &CraftingRecipe::get_by_id);
+    ClassDB::bind_static_method("CraftingRecipe", D_METHOD("find_by_input", "id"), &CraftingRecipe::find_by_input);
+    ClassDB::bind_static_method("CraftingRecipe", D_METHOD("find_by_output", "id"), &CraftingRecipe::find_by_output);
+
+    ClassDB::bind_method(D_METHOD("get_registry_id"), &CraftingRecipe::get_registry_id);
 
     ClassDB::bind_method(D_METHOD("get_inputs"), &CraftingRecipe::get_inputs);
 
     ClassDB::bind_method(D_METHOD("get_output"), &CraftingRecipe::get_output);
     ClassDB::bind_method(D_METHOD("set_output", "output"), &CraftingRecipe::set_output);
+    ClassDB::bind_method(D_METHOD("get_tag_inputs"), &CraftingRecipe::get_tag_inputs);
+    ClassDB::bind_method(D_METHOD("set_tag_inputs", "tag_inputs"), &CraftingRecipe::set_tag_inputs);
 
     ClassDB::bind_method(D_METHOD("craftable", "inventory"), &CraftingRecipe::craftable);
     ClassDB::bind_method(D_METHOD("craft", "inventory"), &CraftingRecipe::craft);
     ClassDB::bind_method(D_METHOD("take_inputs", "inventory"), &CraftingRecipe::take_inputs);
+    ClassDB::bind_method(D_METHOD("max_craftable", "inventory"), &CraftingRecipe::max_craftable);
+    ClassDB::bind_method(D_METHOD("craft_n", "inventory", "count"), &CraftingRecipe::craft_n);
 
     ADD_PROPERTY(PropertyInfo(Variant::OBJECT, "output", PROPERTY_HINT_RESOURCE_TYPE, "Item"), "set_output", "get_output");
+    ADD_PROPERTY(PropertyInfo(Variant::DICTIONARY, "tag_inputs"), "set_tag_inputs", "get_tag_inputs");
 }
 
-bool CraftingRecipe::craftable(Ref<Inventory> inventory) const {
-	ERR_FAIL_NULL_V_MSG(inventory, false, "Attempt to use null inventory");
+void CraftingRecipe::compile_inputs() {
+	compiled_inputs.clear();
+	// Tag candidates reserve what the exact inputs need, so they are found again.
+	tag_candidates_generation = 0;
 	for (int i = 0; i < inputs.size(); i++) {
 		Ref<Item> input = inputs[i];
 		if (Item::is_empty_or_null(input)) {
 			continue;
 		}
-		if (inventory->get_item_count(input->get_id()) < input->get_count()) {
+		CompiledInput compiled;
+		compiled.id = input->get_id();
+		compiled.count = input->get_count();
+		compiled_inputs.push_back(compiled);
+	}
+	compiled_inputs.sort();
+	// Merge inputs that share an id, so two inputs of 5 iron need 10 iron.
+	uint32_t merged = 0;
+	for (uint32_t i = 0; i < compiled_inputs.size(); i++) {
+		if (merged > 0 && compiled_inputs[merged - 1].id == compiled_inputs[i].id) {
+			compiled_inputs[merged - 1].count += compiled_inputs[i].count;
+		} else {
+			if (merged != i) {
+				compiled_inputs[merged] = compiled_inputs[i];
+			}
+			merged++;
+		}
+	}
+	compiled_inputs.resize(merged);
+}
+
+bool CraftingRecipe::craftable(Ref<Inventory> inventory) const {
+	ERR_FAIL_NULL_V_MSG(inventory, false, "Attempt to use null inventory");
+	return is_craftable_in(inventory.ptr());
+}
+
+// Only reads the inventory's count cache, so it is safe to call from several threads while nothing changes it.
+// Tag candidates must be up to date before this is called from several threads, see update_tag_candidates.
+bool CraftingRecipe::is_craftable_in(const Inventory *inventory) const {
+	for (uint32_t i = 0; i < compiled_inputs.size(); i++) {
+		if (inventory->get_item_count(compiled_inputs[i].id) < compiled_inputs[i].count) {
+			return false;
+		}
+	}
+	if (too_many_tag_inputs) {
+		return false;
+	}
+	return compiled_tag_inputs.is_empty() || tags_craftable_in(inventory, 1);
+}
+
+void CraftingRecipe::compile_tag_inputs() {
+	compiled_tag_inputs.clear();
+	tag_candidates_generation = 0;
+	too_many_tag_inputs = false;
+	if (!has_input_list()) {
+		return;
+	}
+	Array tags = tag_inputs.keys();
+	for (int i = 0; i < tags.size(); i++) {
+		CompiledTagInput compiled;
+		compiled.tag = tags[i];
+		compiled.count = tag_inputs[tags[i]];
+		if (compiled.tag == StringName() || compiled.count <= 0) {
+			continue;
+		}
+		compiled_tag_inputs.push_back(compiled);
+	}
+	compiled_tag_inputs.sort();
+	too_many_tag_inputs = compiled_tag_inputs.size() > MAX_TAG_INPUTS;
+	ERR_FAIL_COND_MSG(too_many_tag_inputs, vformat("Crafting recipes can have at most %d tag inputs, this recipe can not be crafted!", MAX_TAG_INPUTS));
+}
+
+void CraftingRecipe::update_tag_candidates() const {
+	uint64_t registry_generation = ItemRegistry::get_singleton()->get_generation();
+	if (tag_candidates_generation == registry_generation) {
+		return;
+	}
+	tag_candidates.clear();
+	for (uint32_t i = 0; i < compiled_tag_inputs.size() && i < MAX_TAG_INPUTS; i++) {
+		const LocalVector<StringName> *ids = ItemRegistry::get_singleton()->get_tag_items(compiled_tag_inputs[i].tag);
+		if (ids == nullptr) {
+			continue;
+		}
+		for (uint32_t j = 0; j < ids->size(); j++) {
+			const StringName &id = (*ids)[j];
+			uint32_t candidate = 0;
+			while (candidate < tag_candidates.size() && tag_candidates[candidate].id != id) {
+				candidate++;
+			}
+			if (candidate == tag_candidates.size()) {
+				TagCandidate added;
+				added.id = id;
+				for (uint32_t k = 0; k < compiled_inputs.size(); k++) {
+					if (compiled_inputs[k].id == id) {
+						added.reserved = compiled_inputs[k].count;
+					}
+				}
+				tag_candidates.push_back(added);
+			}
+			tag_candidates[candidate].mask |= 1 << i;
+		}
+	}
+	tag_candidates_generation = registry_generation;
+}
+
+// Whether the supplies, summed by which tag inputs each item can go to, can cover every demand. By Hall's theorem
+// for supplies and demands, they can exactly when each set of tag inputs demands no more than the items able to go
+// to any of them supply, which the subset sums below check for all 2^tag_count sets at once.
+bool CraftingRecipe::can_supply(const int64_t *demands, int tag_count, int64_t *supply_by_mask) {
+	uint32_t full = (1 << tag_count) - 1;
+	int64_t total = 0;
+	for (uint32_t mask = 0; mask <= full; mask++) {
+		total += supply_by_mask[mask];
+	}
+	// Afterwards supply_by_mask[mask] holds the supply of items that can only go to tag inputs within mask.
+	for (int bit = 0; bit < tag_count; bit++) {
+		for (uint32_t mask = 0; mask <= full; mask++) {
+			if (mask & (1 << bit)) {
+				supply_by_mask[mask] += supply_by_mask[mask ^ (1 << bit)];
+			}
+		}
+	}
+	int64_t demand_by_mask[1 << MAX_TAG_INPUTS];
+	demand_by_mask[0] = 0;
+	for (uint32_t mask = 1; mask <= full; mask++) {
+		int bit = 0;
+		while (!(mask & (1 << bit))) {
+			bit++;
+		}
+		demand_by_mask[mask] = demand_by_mask[mask & (mask - 1)] + demands[bit];
+		if (demand_by_mask[mask] > total - supply_by_mask[full ^ mask]) {
 			return false;
 		}
 	}
 	return true;
 }
 
-bool CraftingRecipe::take_inputs(Ref<Inventory> inventory) const {
-	if (craftable(inventory)) {
-		for (int i = 0; i < inputs.size(); i++) {
-			Ref<Item> input = inputs[i];
-			if (Item::is_empty_or_null(input)) {
+// Only reads the inventory's count cache.
+bool CraftingRecipe::tags_craftable_in(const Inventory *inventory, int64_t crafts) const {
+	int tag_count = MIN((int)compiled_tag_inputs.size(), MAX_TAG_INPUTS);
+	int64_t demands[MAX_TAG_INPUTS];
+	int64_t supply_by_mask[1 << MAX_TAG_INPUTS];
+	for (int i = 0; i < tag_count; i++) {
+		demands[i] = (int64_t)compiled_tag_inputs[i].count * crafts;
+	}
+	for (int mask = 0; mask < (1 << tag_count); mask++) {
+		supply_by_mask[mask] = 0;
+	}
+	update_tag_candidates();
+	for (uint32_t i = 0; i < tag_candidates.size(); i++) {
+		const TagCandidate &candidate = tag_candidates[i];
+		int64_t supply = inventory->get_item_count(candidate.id) - (int64_t)candidate.reserved * crafts;
+		if (supply > 0) {
+			supply_by_mask[candidate.mask] += supply;
+		}
+	}
+	return can_supply(demands, tag_count, supply_by_mask);
+}
+
+// Takes the tag inputs once the exact inputs have been taken. Each tag input in turn takes as much of each of its
+// candidates as any complete allocation could give it, found with can_supply, and then stops using that candidate.
+// What is left can still be allocated without it, so the tag input is covered once its last candidate is done.
+void CraftingRecipe::take_tag_inputs(Inventory *inventory, int64_t crafts) const {
+	int tag_count = MIN((int)compiled_tag_inputs.size(), MAX_TAG_INPUTS);
+	if (tag_count == 0) {
+		return;
+	}
+	update_tag_candidates();
+	int64_t demands[MAX_TAG_INPUTS];
+	int64_t supply_by_mask[1 << MAX_TAG_INPUTS];
+	for (int i = 0; i < tag_count; i++) {
+		demands[i] = (int64_t)compiled_tag_inputs[i].count * crafts;
+	}
+	LocalVector<uint32_t> masks;
+	LocalVector<int64_t> supplies;
+	LocalVector<int64_t> taken;
+	masks.resize(tag_candidates.size());
+	supplies.resize(tag_candidates.size());
+	taken.resize(tag_candidates.size());
+	for (uint32_t i = 0; i < tag_candidates.size(); i++) {
+		masks[i] = tag_candidates[i].mask;
+		supplies[i] = MAX(0, (int64_t)inventory->get_item_count(tag_candidates[i].id));
+		taken[i] = 0;
+	}
+	for (int tag = 0; tag < tag_count; tag++) {
+		for (uint32_t i = 0; i < masks.size() && demands[tag] > 0; i++) {
+			if (!(masks[i] & (1 << tag))) {
 				continue;
 			}
-			inventory->take_item(input->get_id(), input->get_count());
+			// Taking x is feasible while some allocation gives this candidate at least x to the tag input, and
+			// then taking less is feasible too, so search for the largest x.
+			int64_t low = 0;
+			int64_t high = MIN(demands[tag], supplies[i]);
+			while (low < high) {
+				int64_t x = (low + high + 1) / 2;
+				demands[tag] -= x;
+				supplies[i] -= x;
+				for (int mask = 0; mask < (1 << tag_count); mask++) {
+					supply_by_mask[mask] = 0;
+				}
+				for (uint32_t j = 0; j < masks.size(); j++) {
+					supply_by_mask[masks[j]] += supplies[j];
+				}
+				bool feasible = can_supply(demands, tag_count, supply_by_mask);
+				demands[tag] += x;
+				supplies[i] += x;
+				if (feasible) {
+					low = x;
+				} else {
+					high = x - 1;
+				}
+			}
+			demands[tag] -= low;
+			supplies[i] -= low;
+			taken[i] += low;
+			masks[i] &= ~(1 << tag);
+		}
+		DEV_ASSERT(demands[tag] == 0);
+	}
+	for (uint32_t i = 0; i < taken.size(); i++) {
+		if (taken[i] > 0) {
+			inventory->take_item(tag_candidates[i].id, (int)taken[i]);
+		}
+	}
+}
+
+bool CraftingRecipe::take_inputs(Ref<Inventory> inventory) const {
+	if (craftable(inventory)) {
+		inventory->begin_batch();
+		for (uint32_t i = 0; i < compiled_inputs.size(); i++) {
+			inventory->take_item(compiled_inputs[i].id, compiled_inputs[i].count);
 		}
+		take_tag_inputs(inventory.ptr(), 1);
+		inventory->commit();
 		return true;
 	} else {
 		return false;
@@ -49,27 +274,103 @@ Ref<Item> CraftingRecipe::craft(Ref<Inventory> inventory) const {
 	if (take_inputs(inventory)) {
 		Ref<Item> output = get_output();
 		if (output.is_null()) {
-			return memnew(Item);
+			return Item::get_empty();
 		} else {
 			return output->clone();
 		}
 	} else {
-		return memnew(Item);
+		return Item::get_empty();
 	}
 }
 
+// Number of times the recipe could be crafted from the inventory. Recipes without inputs are limited to INT32_MAX.
+int CraftingRecipe::max_craftable(Ref<Inventory> inventory) const {
+	ERR_FAIL_NULL_V_MSG(inventory, 0, "Attempt to use null inventory");
+	if (too_many_tag_inputs) {
+		return 0;
+	}
+	int output = INT32_MAX;
+	for (uint32_t i = 0; i < compiled_inputs.size(); i++) {
+		output = MIN(output, inventory->get_item_count(compiled_inputs[i].id) / compiled_inputs[i].count);
+	}
+	if (compiled_tag_inputs.is_empty() || output == 0) {
+		return output;
+	}
+	// Tag inputs can not need less than their total from all candidates, and being craftable n times means being
+	// craftable fewer times, so search below that bound.
+	update_tag_candidates();
+	int64_t supply = 0;
+	int64_t demand = 0;
+	for (uint32_t i = 0; i < tag_candidates.size(); i++) {
+		supply += inventory->get_item_count(tag_candidates[i].id);
+	}
+	for (uint32_t i = 0; i < compiled_tag_inputs.size() && i < MAX_TAG_INPUTS; i++) {
+		demand += compiled_tag_inputs[i].count;
+	}
+	int low = 0;
+	int high = (int)MIN((int64_t)output, supply / demand);
+	while (low < high) {
+		int crafts = low + (high - low + 1) / 2;
+		if (tags_craftable_in(inventory.ptr(), crafts)) {
+			low = crafts;
+		} else {
+			high = crafts - 1;
+		}
+	}
+	return low;
+}
+
+// Crafts the recipe up to count times, taking all inputs at once, and returns the outputs split into stacks.
+TypedArray<Item> CraftingRecipe::craft_n(Ref<Inventory> inventory, int count) const {
+	TypedArray<Item> outputs;
+	ERR_FAIL_NULL_V_MSG(inventory, outputs, "Attempt to use null inventory");
+	count = MIN(count, max_craftable(inventory));
+	if (count <= 0) {
+		return outputs;
+	}
+	inventory->begin_batch();
+	for (uint32_t i = 0; i < compiled_inputs.size(); i++) {
+		inventory->take_item(compiled_inputs[i].id, compiled_inputs[i].count * count);
+	}
+	take_tag_inputs(inventory.ptr(), count);
+	inventory->commit();
+	if (Item::is_empty_or_null(output)) {
+		return outputs;
+	}
+	int stack_size = MAX(1, output->get_data()->get_stack_size());
+	int64_t remaining = (int64_t)output->get_count() * count;
+	while (remaining > 0) {
+		int stack_count = (int)MIN(remaining, (int64_t)stack_size);
+		outputs.append(memnew(Item(output->get_id(), stack_count)));
+		remaining -= stack_count;
+	}
+	return outputs;
+}
+
 void CraftingRecipe::_get_property_list(List<PropertyInfo> *r_props) const {
+	if (!has_input_list()) {
+		return;
+	}
 	for (int i = 0; i < inputs.size(); i++) {
 		r_props->push_back(PropertyInfo(Variant::OBJECT, "Input " + String::num_int64(i), PROPERTY_HINT_RESOURCE_TYPE, "Item"));
 	}
 	r_props->push_back(PropertyInfo(Variant::OBJECT, "New Input", PROPERTY_HINT_RESOURCE_TYPE, "Item"));
 }
 
-Vector<Ref<CraftingRecipe>> CraftingRecipe::recipes = Vector<Ref<CraftingRecipe>>();
+HashMap<StringName, Ref<CraftingRecipe>> CraftingRecipe::recipes;
+uint64_t CraftingRecipe::next_recipe_id = 0;
+HashMap<StringName, LocalVector<Ref<CraftingRecipe>>> CraftingRecipe::recipes_by_input;
+HashMap<StringName, LocalVector<Ref<CraftingRecipe>>> CraftingRecipe::recipes_by_output;
+HashMap<StringName, LocalVector<Ref<CraftingRecipe>>> CraftingRecipe::recipes_by_tag;
+// Starts ahead of index_generation and of every inventory, so the first use builds everything.
+uint64_t CraftingRecipe::generation = 1;
+uint64_t CraftingRecipe::index_generation = 0;
+HashMap<StringName, LocalVector<CraftingRecipe::Producer>> CraftingRecipe::producers;
+HashMap<StringName, int> CraftingRecipe::craft_depths;
 
 bool CraftingRecipe::_get(const StringName &p_property, Variant &r_value) const {
 	String property = p_property;
-	if (!property.contains("Input")) {
+	if (!has_input_list() || !property.contains("Input")) {
 		return false;
 	}
 	String id = property.trim_prefix("Input ");
@@ -89,7 +390,7 @@ bool CraftingRecipe::_get(const StringName &p_property, Variant &r_value) const
 
 bool CraftingRecipe::_set(const StringName &p_property, const Variant &p_value) {
 	String property = p_property;
-	if (!property.contains("Input")) {
+	if (!has_input_list() || !property.contains("Input")) {
 		return false;
 	}
 	String id = property.trim_prefix("Input ");
@@ -112,11 +413,15 @@ bool CraftingRecipe::_set(const StringName &p_property, const Variant &p_value)
 				notify_property_list_changed();
 			}
 		}
+		compile_inputs();
+		update_registration();
 		return true;
 	}
 	if (!is_nil) {
 		inputs.push_back(p_value);
 		notify_property_list_changed();
+		compile_inputs();
+		update_registration();
 	}
 	return true;
 }
@@ -138,38 +443,566 @@ Ref<Item> CraftingRecipe::get_output() const {
 
 void CraftingRecipe::set_output(Ref<Item> output) {
     this->output = output;
+    update_registration();
+}
+
+Dictionary CraftingRecipe::get_tag_inputs() const {
+    return tag_inputs;
+}
+
+void CraftingRecipe::set_tag_inputs(Dictionary tag_inputs) {
+    this->tag_inputs = tag_inputs;
+    compile_tag_inputs();
+    update_registration();
 }
 
-void CraftingRecipe::register_recipe(Ref<CraftingRecipe> recipe) {
-	ERR_FAIL_NULL_MSG(recipe, "Attempt to register a null crafting recipe");
-	recipes.push_back(recipe);
+StringName CraftingRecipe::get_registry_id() const {
+    return registry_id;
+}
+
+HashMap<StringName, LocalVector<Ref<CraftingRecipe>>> &CraftingRecipe::get_index(IndexKind kind) {
+	switch (kind) {
+		case INDEX_OUTPUT:
+			return recipes_by_output;
+		case INDEX_TAG:
+			return recipes_by_tag;
+		default:
+			return recipes_by_input;
+	}
+}
+
+void CraftingRecipe::add_index_entry(IndexKind kind, const StringName &id) {
+	LocalVector<Ref<CraftingRecipe>> &list = get_index(kind)[id];
+	IndexEntry entry;
+	entry.id = id;
+	entry.kind = kind;
+	entry.position = list.size();
+	index_entries.push_back(entry);
+	list.push_back(Ref<CraftingRecipe>(this));
+}
+
+void CraftingRecipe::add_to_index() {
+	for (uint32_t i = 0; i < compiled_inputs.size(); i++) {
+		add_index_entry(INDEX_INPUT, compiled_inputs[i].id);
+	}
+	for (uint32_t i = 0; i < compiled_tag_inputs.size(); i++) {
+		add_index_entry(INDEX_TAG, compiled_tag_inputs[i].tag);
+	}
+	if (!Item::is_empty_or_null(output)) {
+		add_index_entry(INDEX_OUTPUT, output->get_id());
+	}
+}
+
+// Swaps each of this recipe's index entries with the last one of its list, so removal never shifts the lists.
+void CraftingRecipe::remove_from_index() {
+	for (uint32_t i = 0; i < index_entries.size(); i++) {
+		const IndexEntry &entry = index_entries[i];
+		HashMap<StringName, LocalVector<Ref<CraftingRecipe>>> &index = get_index(entry.kind);
+		LocalVector<Ref<CraftingRecipe>> *list = index.getptr(entry.id);
+		ERR_CONTINUE(list == nullptr || entry.position >= list->size());
+		uint32_t last = list->size() - 1;
+		if (entry.position != last) {
+			Ref<CraftingRecipe> moved = (*list)[last];
+			(*list)[entry.position] = moved;
+			for (uint32_t j = 0; j < moved->index_entries.size(); j++) {
+				IndexEntry &moved_entry = moved->index_entries[j];
+				if (moved_entry.kind == entry.kind && moved_entry.id == entry.id) {
+					moved_entry.position = entry.position;
+					break;
+				}
+			}
+		}
+		list->resize(last);
+		if (list->is_empty()) {
+			index.erase(entry.id);
+		}
+	}
+	index_entries.clear();
+}
+
+void CraftingRecipe::update_registration() {
+	if (registry_id != StringName()) {
+		remove_from_index();
+		add_to_index();
+	}
+	generation++;
+}
+
+// Registers the recipe under id, replacing any recipe already registered under it, and returns the id.
+// Without an id, the recipe's resource path is used if it has one, so reloading a recipe file replaces it.
+StringName CraftingRecipe::register_recipe(Ref<CraftingRecipe> recipe, StringName id) {
+	ERR_FAIL_NULL_V_MSG(recipe, StringName(), "Attempt to register a null crafting recipe");
+	if (id == StringName()) {
+		if (!recipe->get_path().is_empty()) {
+			id = recipe->get_path();
+		} else {
+			id = "recipe_" + itos(next_recipe_id++);
+		}
+	}
+	ERR_FAIL_COND_V_MSG(recipe->registry_id != StringName() && recipe->registry_id != id, recipe->registry_id, vformat("Attempt to register a crafting recipe as '%s' that is already registered as '%s'!", id, recipe->registry_id));
+	// Input items may have been changed since they were set.
+	recipe->compile_inputs();
+	recipe->compile_tag_inputs();
+	ERR_FAIL_COND_V_MSG(recipe->too_many_tag_inputs, StringName(), vformat("Attempt to register crafting recipe '%s' with more than %d tag inputs!", id, MAX_TAG_INPUTS));
+	Ref<CraftingRecipe> *existing = recipes.getptr(id);
+	if (existing != nullptr) {
+		(*existing)->remove_from_index();
+		(*existing)->registry_id = StringName();
+		*existing = recipe;
+	} else {
+		recipes.insert(id, recipe);
+	}
+	recipe->registry_id = id;
+	recipe->add_to_index();
+	generation++;
+	return id;
+}
+
+void CraftingRecipe::unregister_recipe(StringName id) {
+	Ref<CraftingRecipe> *recipe = recipes.getptr(id);
+	ERR_FAIL_NULL_MSG(recipe, vformat("Attempt to unregister crafting recipe '%s' that is not registered!", id));
+	(*recipe)->remove_from_index();
+	(*recipe)->registry_id = StringName();
+	recipes.erase(id);
+	generation++;
+}
+
+void CraftingRecipe::unregister_all() {
+	for (KeyValue<StringName, Ref<CraftingRecipe>> &E : recipes) {
+		E.value->remove_from_index();
+		E.value->registry_id = StringName();
+	}
+	recipes.clear();
+	recipes_by_input.clear();
+	recipes_by_output.clear();
+	recipes_by_tag.clear();
+	producers.clear();
+	craft_depths.clear();
+	generation++;
+}
+
+Ref<CraftingRecipe> CraftingRecipe::get_by_id(StringName id) {
+	Ref<CraftingRecipe> *recipe = recipes.getptr(id);
+	return recipe != nullptr ? *recipe : Ref<CraftingRecipe>();
+}
+
+// Recipes with an input of the id, or a tag input accepting it.
+TypedArray<CraftingRecipe> CraftingRecipe::find_by_input(StringName id) {
+	TypedArray<CraftingRecipe> output;
+	HashSet<CraftingRecipe *> found;
+	const LocalVector<Ref<CraftingRecipe>> *list = recipes_by_input.getptr(id);
+	if (list != nullptr) {
+		for (uint32_t i = 0; i < list->size(); i++) {
+			found.insert((*list)[i].ptr());
+			output.append((*list)[i]);
+		}
+	}
+	const LocalVector<StringName> *tags = ItemRegistry::get_singleton()->get_item_tags(id);
+	if (tags != nullptr) {
+		for (uint32_t i = 0; i < tags->size(); i++) {
+			list = recipes_by_tag.getptr((*tags)[i]);
+			if (list == nullptr) {
+				continue;
+			}
+			for (uint32_t j = 0; j < list->size(); j++) {
+				if (!found.has((*list)[j].ptr())) {
+					found.insert((*list)[j].ptr());
+					output.append((*list)[j]);
+				}
+			}
+		}
+	}
+	return output;
+}
+
+TypedArray<CraftingRecipe> CraftingRecipe::find_by_output(StringName id) {
+	TypedArray<CraftingRecipe> output;
+	const LocalVector<Ref<CraftingRecipe>> *list = recipes_by_output.getptr(id);
+	if (list != nullptr) {
+		for (uint32_t i = 0; i < list->size(); i++) {
+			output.append((*list)[i]);
+		}
+	}
+	return output;
+}
+
+const HashMap<StringName, Ref<CraftingRecipe>> &CraftingRecipe::get_registered() {
+	return recipes;
+}
+
+void CraftingRecipe::push_ready(LocalVector<LocalVector<const CraftingRecipe *>> &ready, const CraftingRecipe *recipe, int depth) {
+	if ((int)ready.size() <= depth) {
+		ready.resize(depth + 1);
+	}
+	ready[depth].push_back(recipe);
+}
+
+// Counts id as having a depth for every recipe using it, and queues the recipes that were only waiting on it.
+void CraftingRecipe::release_users(const HashMap<StringName, LocalVector<const CraftingRecipe *>> &users, HashMap<const CraftingRecipe *, int> &waiting, HashMap<const CraftingRecipe *, int> &recipe_depths, LocalVector<LocalVector<const CraftingRecipe *>> &ready, const StringName &id, int depth) {
+	const LocalVector<const CraftingRecipe *> *list = users.getptr(id);
+	if (list == nullptr) {
+		return;
+	}
+	for (uint32_t i = 0; i < list->size(); i++) {
+		const CraftingRecipe *user = (*list)[i];
+		int &user_depth = recipe_depths[user];
+		user_depth = MAX(user_depth, depth + 1);
+		if (--waiting[user] == 0) {
+			push_ready(ready, user, user_depth);
+		}
+	}
+}
+
+void CraftingRecipe::update_index() {
+	if (index_generation == generation) {
+		return;
+	}
+	producers.clear();
+	craft_depths.clear();
+	int order = 0;
+	for (const KeyValue<StringName, Ref<CraftingRecipe>> &E : recipes) {
+		const Ref<CraftingRecipe> &recipe = E.value;
+		if (!Item::is_empty_or_null(recipe->output)) {
+			Producer producer;
+			producer.recipe = recipe;
+			producer.order = order;
+			producers[recipe->output->get_id()].push_back(producer);
+		}
+		order++;
+	}
+	// Depths are found in order, up from the items that cannot be crafted. A recipe is ready once each of its
+	// craftable inputs has a depth, one more than its deepest input, and the first ready recipe of an id gives the id
+	// its depth. When no recipe is ready, the rest wait on ids only craftable through a cycle, so the first of those
+	// is counted as uncraftable and the search goes on from there.
+	HashMap<const CraftingRecipe *, int> waiting;
+	HashMap<const CraftingRecipe *, int> recipe_depths;
+	HashMap<StringName, LocalVector<const CraftingRecipe *>> users;
+	LocalVector<LocalVector<const CraftingRecipe *>> ready;
+	for (const KeyValue<StringName, LocalVector<Producer>> &E : producers) {
+		for (uint32_t i = 0; i < E.value.size(); i++) {
+			const CraftingRecipe *recipe = E.value[i].recipe.ptr();
+			int craftable_inputs = 0;
+			for (uint32_t j = 0; j < recipe->compiled_inputs.size(); j++) {
+				if (producers.has(recipe->compiled_inputs[j].id)) {
+					users[recipe->compiled_inputs[j].id].push_back(recipe);
+					craftable_inputs++;
+				}
+			}
+			waiting[recipe] = craftable_inputs;
+			recipe_depths[recipe] = 1;
+			if (craftable_inputs == 0) {
+				push_ready(ready, recipe, 1);
+			}
+		}
+	}
+	uint32_t level = 1;
+	while (true) {
+		while (level < ready.size()) {
+			if (ready[level].is_empty()) {
+				level++;
+				continue;
+			}
+			const CraftingRecipe *recipe = ready[level][ready[level].size() - 1];
+			ready[level].resize(ready[level].size() - 1);
+			const StringName &id = recipe->output->get_id();
+			if (!craft_depths.has(id)) {
+				craft_depths[id] = level;
+				release_users(users, waiting, recipe_depths, ready, id, level);
+			}
+		}
+		const StringName *stalled = nullptr;
+		for (const KeyValue<StringName, LocalVector<const CraftingRecipe *>> &E : users) {
+			if (craft_depths.has(E.key)) {
+				continue;
+			}
+			for (uint32_t i = 0; i < E.value.size() && stalled == nullptr; i++) {
+				if (waiting[E.value[i]] > 0) {
+					stalled = &E.key;
+				}
+			}
+			if (stalled != nullptr) {
+				break;
+			}
+		}
+		if (stalled == nullptr) {
+			break;
+		}
+		StringName id = *stalled;
+		craft_depths[id] = 0;
+		release_users(users, waiting, recipe_depths, ready, id, 0);
+		// Released recipes can be shallower than the level reached so far.
+		level = 1;
+	}
+	// Recipes of ids only craftable through a cycle stay, since the planner can still use them when it has the
+	// items that start the cycle, such as blocks to make ingots from.
+	for (KeyValue<StringName, LocalVector<Producer>> &E : producers) {
+		LocalVector<Producer> &list = E.value;
+		for (uint32_t i = 0; i < list.size(); i++) {
+			const CraftingRecipe *recipe = list[i].recipe.ptr();
+			list[i].depth = waiting[recipe] == 0 ? recipe_depths[recipe] : INT32_MAX;
+		}
+		list.sort();
+	}
+	index_generation = generation;
+}
+
+// Registered recipes with an input of the given id, or nullptr if there are none.
+const LocalVector<Ref<CraftingRecipe>> *CraftingRecipe::get_recipes_using(const StringName &id) {
+	return recipes_by_input.getptr(id);
+}
+
+// Registered recipes with a tag input of the given tag, or nullptr if there are none.
+const LocalVector<Ref<CraftingRecipe>> *CraftingRecipe::get_recipes_using_tag(const StringName &tag) {
+	return recipes_by_tag.getptr(tag);
 }
 
 TypedArray<CraftingRecipe> CraftingRecipe::all_craftable(Ref<Inventory> inventory) {
 	TypedArray<CraftingRecipe> output;
 	ERR_FAIL_NULL_V_MSG(inventory, output, "Attempt to determine craftable recipes within a null inventory!");
-	for (int i = 0; i < recipes.size(); i++) {
-		Ref<CraftingRecipe> recipe = recipes[i];
-		if (recipe.is_valid() && recipe->craftable(inventory)) {
-			output.append(recipe);
+	for (const KeyValue<StringName, Ref<CraftingRecipe>> &E : recipes) {
+		if (E.value->craftable(inventory)) {
+			output.append(E.value);
 		}
 	}
 	return output;
 }
 
+void CraftingRecipe::check_craftable_batch(void *p_batch, uint32_t p_index) {
+	CraftableBatch *batch = (CraftableBatch *)p_batch;
+	const Inventory *inventory = batch->inventories[p_index];
+	if (inventory == nullptr) {
+		return;
+	}
+	LocalVector<int> &craftable = batch->craftable[p_index];
+	for (uint32_t i = 0; i < batch->recipes.size(); i++) {
+		if (batch->recipes[i]->is_craftable_in(inventory)) {
+			craftable.push_back(i);
+		}
+	}
+}
+
+// Like all_craftable for each inventory, with the inventories checked in parallel on the WorkerThreadPool.
+// The inventories must not be changed until this returns.
+Array CraftingRecipe::all_craftable_batch(TypedArray<Inventory> inventories) {
+	CraftableBatch batch;
+	batch.recipes.reserve(recipes.size());
+	for (const KeyValue<StringName, Ref<CraftingRecipe>> &E : recipes) {
+		// Nothing may be rebuilt once the threads read the recipes.
+		E.value->update_tag_candidates();
+		batch.recipes.push_back(E.value.ptr());
+	}
+	batch.inventories.resize(inventories.size());
+	batch.craftable.resize(inventories.size());
+	for (int i = 0; i < inventories.size(); i++) {
+		batch.inventories[i] = Object::cast_to<Inventory>(inventories[i]);
+	}
+	if (inventories.size() > 0) {
+		WorkerThreadPool::GroupID group = WorkerThreadPool::get_singleton()->add_native_group_task(&CraftingRecipe::check_craftable_batch, &batch, inventories.size(), -1, true, SNAME("Check craftable recipes"));
+		WorkerThreadPool::get_singleton()->wait_for_group_task_completion(group);
+	}
+	Array output;
+	output.resize(inventories.size());
+	for (int i = 0; i < inventories.size(); i++) {
+		TypedArray<CraftingRecipe> craftable;
+		for (uint32_t j = 0; j < batch.craftable[i].size(); j++) {
+			craftable.append(Ref<CraftingRecipe>(batch.recipes[batch.craftable[i][j]]));
+		}
+		output[i] = craftable;
+	}
+	return output;
+}
+
+uint64_t CraftingRecipe::PlanState::get_version() const {
+	return undo.is_empty() ? 0 : undo[undo.size() - 1].version;
+}
+
+// Asking for more of an id from the same stock can only fail too.
+bool CraftingRecipe::PlanState::has_failed(const StringName &id, int64_t amount) const {
+	const LocalVector<PlanFailure> *list = failures.getptr(id);
+	if (list == nullptr) {
+		return false;
+	}
+	uint64_t version = get_version();
+	for (uint32_t i = 0; i < list->size(); i++) {
+		if ((*list)[i].version == version && (*list)[i].amount <= amount) {
+			return true;
+		}
+	}
+	return false;
+}
+
+int64_t CraftingRecipe::PlanState::get_stock(const StringName &id) const {
+	const int64_t *count = stock.getptr(id);
+	return count != nullptr ? *count : inventory->get_item_count(id);
+}
+
+void CraftingRecipe::PlanState::set_stock(const StringName &id, int64_t count) {
+	PlanUndo entry;
+	entry.id = id;
+	const int64_t *previous = stock.getptr(id);
+	if (previous != nullptr) {
+		entry.previous = *previous;
+		entry.existed = true;
+	}
+	entry.version = next_version++;
+	undo.push_back(entry);
+	stock[id] = count;
+}
+
+void CraftingRecipe::PlanState::rollback(uint32_t undo_mark, uint32_t step_mark) {
+	for (uint32_t i = undo.size(); i > undo_mark; i--) {
+		const PlanUndo &entry = undo[i - 1];
+		if (entry.existed) {
+			stock[entry.id] = entry.previous;
+		} else {
+			stock.erase(entry.id);
+		}
+	}
+	undo.resize(undo_mark);
+	steps.resize(step_mark);
+}
+
+// Gets amount of id for the plan, from stock first and then by crafting the rest. Without report, this gives up on
+// the first shortfall and leaves rolling back to the caller. With report, it goes on and records every shortfall.
+bool CraftingRecipe::plan_request(PlanState &state, const StringName &id, int64_t amount, bool report) {
+	// Sub-plans depend on the stock left by earlier steps, so only failures are remembered, with that stock.
+	if (!report && state.has_failed(id, amount)) {
+		return false;
+	}
+	uint64_t version = state.get_version();
+	uint32_t cycle_cuts = state.cycle_cuts;
+	int64_t available = state.get_stock(id);
+	int64_t taken = MIN(available, amount);
+	if (taken > 0) {
+		state.set_stock(id, available - taken);
+		amount -= taken;
+	}
+	if (amount <= 0) {
+		return true;
+	}
+	const LocalVector<Producer> *list = producers.getptr(id);
+	if (list == nullptr || list->is_empty() || state.visiting.has(id)) {
+		if (list != nullptr && !list->is_empty()) {
+			state.cycle_cuts++;
+		}
+		if (report) {
+			state.missing[id] = (state.missing.has(id) ? state.missing[id] : 0) + amount;
+		}
+		return false;
+	}
+	state.visiting.insert(id);
+	bool planned = false;
+	for (uint32_t i = 0; i < list->size(); i++) {
+		uint32_t undo_mark = state.undo.size();
+		uint32_t step_mark = state.steps.size();
+		if (plan_recipe(state, (*list)[i].recipe, id, amount, false)) {
+			planned = true;
+			break;
+		}
+		state.rollback(undo_mark, step_mark);
+	}
+	if (!planned && report) {
+		// Report what the shallowest recipe would be missing.
+		plan_recipe(state, (*list)[0].recipe, id, amount, true);
+	}
+	state.visiting.erase(id);
+	if (!planned && !report && state.cycle_cuts == cycle_cuts) {
+		PlanFailure failure;
+		failure.amount = amount + taken;
+		failure.version = version;
+		state.failures[id].push_back(failure);
+	}
+	return planned;
+}
+
+bool CraftingRecipe::plan_recipe(PlanState &state, const Ref<CraftingRecipe> &recipe, const StringName &id, int64_t amount, bool report) {
+	if (recipe->too_many_tag_inputs) {
+		return false;
+	}
+	int64_t per_craft = MAX(1, recipe->output->get_count());
+	int64_t crafts = (amount + per_craft - 1) / per_craft;
+	bool planned = true;
+	for (uint32_t i = 0; i < recipe->compiled_inputs.size(); i++) {
+		const CompiledInput &input = recipe->compiled_inputs[i];
+		if (!plan_request(state, input.id, input.count * crafts, report)) {
+			planned = false;
+			if (!report) {
+				return false;
+			}
+		}
+	}
+	// Tag inputs are only taken from what is on hand, first come first served, and never crafted.
+	recipe->update_tag_candidates();
+	for (uint32_t i = 0; i < recipe->compiled_tag_inputs.size() && i < MAX_TAG_INPUTS; i++) {
+		int64_t needed = recipe->compiled_tag_inputs[i].count * crafts;
+		for (uint32_t j = 0; j < recipe->tag_candidates.size() && needed > 0; j++) {
+			const TagCandidate &candidate = recipe->tag_candidates[j];
+			if (!(candidate.mask & (1 << i))) {
+				continue;
+			}
+			int64_t available = state.get_stock(candidate.id);
+			int64_t taken = MIN(available, needed);
+			if (taken > 0) {
+				state.set_stock(candidate.id, available - taken);
+				needed -= taken;
+			}
+		}
+		if (needed > 0) {
+			planned = false;
+			if (!report) {
+				return false;
+			}
+			const StringName &tag = recipe->compiled_tag_inputs[i].tag;
+			state.missing[tag] = (state.missing.has(tag) ? state.missing[tag] : 0) + needed;
+		}
+	}
+	// Whatever the last craft makes beyond amount is left for later steps.
+	state.set_stock(id, state.get_stock(id) + crafts * per_craft - amount);
+	PlanStep step;
+	step.recipe = recipe;
+	step.count = crafts;
+	state.steps.push_back(step);
+	return planned;
+}
+
+// Plans how to get count of id into the inventory using registered recipes, crafting intermediate items as needed.
+// Returns a dictionary with "complete", "steps" (recipes to craft in order, with the number of crafts) and "missing"
+// (ids and counts of uncraftable items the inventory lacks). Incomplete plans list the steps of the closest plan.
+Dictionary CraftingRecipe::plan(Ref<Inventory> inventory, StringName id, int count) {
+	Dictionary output;
+	ERR_FAIL_NULL_V_MSG(inventory, output, "Attempt to plan crafting within a null inventory!");
+	update_index();
+	PlanState state;
+	state.inventory = inventory.ptr();
+	bool complete = plan_request(state, id, count, true);
+	Array steps;
+	for (uint32_t i = 0; i < state.steps.size(); i++) {
+		Dictionary step;
+		step["recipe"] = state.steps[i].recipe;
+		step["count"] = state.steps[i].count;
+		steps.append(step);
+	}
+	Dictionary missing;
+	for (const KeyValue<StringName, int64_t> &E : state.missing) {
+		missing[E.key] = E.value;
+	}
+	output["complete"] = complete;
+	output["steps"] = steps;
+	output["missing"] = missing;
+	return output;
+}
+
 TypedArray<CraftingRecipe> CraftingRecipe::all_registered() {
 	TypedArray<CraftingRecipe> output;
-	for (int i = 0; i < recipes.size(); i++) {
-		Ref<CraftingRecipe> recipe = recipes[i];
-		if (recipe.is_valid()) {
-			output.append(recipe);
-		}
+	for (const KeyValue<StringName, Ref<CraftingRecipe>> &E : recipes) {
+		output.append(E.value);
 	}
 	return output;
 }
 
 CraftingRecipe::CraftingRecipe() {
     output = Ref<Item>(nullptr);
+    tag_candidates_generation = 0;
 }
 
 CraftingRecipe::~CraftingRecipe() {
@@ -178,5 +1011,296 @@ CraftingRecipe::~CraftingRecipe() {
 }
 
 void CraftingRecipe::unregister_hook() {
-	recipes.clear();
-}
\ No newline at end of file
+	unregister_all();
+}
+void ShapedCraftingRecipe::_bind_methods() {
+    ClassDB::bind_static_method("ShapedCraftingRecipe", D_METHOD("find_for_grid", "grid", "grid_width"), &ShapedCraftingRecipe::find_for_grid);
+
+    ClassDB::bind_method(D_METHOD("get_pattern"), &ShapedCraftingRecipe::get_pattern);
+    ClassDB::bind_method(D_METHOD("set_pattern", "pattern"), &ShapedCraftingRecipe::set_pattern);
+    ClassDB::bind_method(D_METHOD("get_width"), &ShapedCraftingRecipe::get_width);
+    ClassDB::bind_method(D_METHOD("set_width", "width"), &ShapedCraftingRecipe::set_width);
+    ClassDB::bind_method(D_METHOD("is_mirrorable"), &ShapedCraftingRecipe::is_mirrorable);
+    ClassDB::bind_method(D_METHOD("set_mirrorable", "mirrorable"), &ShapedCraftingRecipe::set_mirrorable);
+
+    ClassDB::bind_method(D_METHOD("matches_grid", "grid", "grid_width"), &ShapedCraftingRecipe::matches_grid);
+    ClassDB::bind_method(D_METHOD("craft_in_grid", "grid", "grid_width"), &ShapedCraftingRecipe::craft_in_grid);
+
+    ADD_PROPERTY(PropertyInfo(Variant::ARRAY, "pattern", PROPERTY_HINT_ARRAY_TYPE, "Item"), "set_pattern", "get_pattern");
+    ADD_PROPERTY(PropertyInfo(Variant::INT, "width"), "set_width", "get_width");
+    ADD_PROPERTY(PropertyInfo(Variant::BOOL, "mirrorable"), "set_mirrorable", "is_mirrorable");
+}
+
+HashMap<uint32_t, LocalVector<ShapedCraftingRecipe::ShapeMatch>> ShapedCraftingRecipe::recipes_by_shape;
+
+// Only ids go into the hash, so a grid holding more than a cell needs still finds the recipe.
+uint32_t ShapedCraftingRecipe::Shape::hash(bool mirrored) const {
+	uint32_t h = hash_murmur3_one_32(width);
+	h = hash_murmur3_one_32(height, h);
+	for (int y = 0; y < height; y++) {
+		for (int x = 0; x < width; x++) {
+			h = hash_murmur3_one_32(ids[get_cell(x, y, mirrored)].hash(), h);
+		}
+	}
+	return hash_fmix32(h);
+}
+
+void ShapedCraftingRecipe::trim_cells(int cell_count, int cells_width, const StringName *ids, const int *counts, Shape &r_shape) {
+	r_shape.width = 0;
+	r_shape.height = 0;
+	r_shape.ids.clear();
+	r_shape.counts.clear();
+	r_shape.slots.clear();
+	int min_x = cells_width;
+	int min_y = INT32_MAX;
+	int max_x = -1;
+	int max_y = -1;
+	for (int i = 0; i < cell_count; i++) {
+		if (ids[i] == StringName() || counts[i] <= 0) {
+			continue;
+		}
+		min_x = MIN(min_x, i % cells_width);
+		max_x = MAX(max_x, i % cells_width);
+		min_y = MIN(min_y, i / cells_width);
+		max_y = MAX(max_y, i / cells_width);
+	}
+	if (max_x < 0) {
+		return;
+	}
+	r_shape.width = max_x - min_x + 1;
+	r_shape.height = max_y - min_y + 1;
+	r_shape.ids.resize(r_shape.width * r_shape.height);
+	r_shape.counts.resize(r_shape.width * r_shape.height);
+	r_shape.slots.resize(r_shape.width * r_shape.height);
+	for (int y = 0; y < r_shape.height; y++) {
+		for (int x = 0; x < r_shape.width; x++) {
+			int cell = y * r_shape.width + x;
+			int source = (min_y + y) * cells_width + min_x + x;
+			r_shape.slots[cell] = source;
+			if (source < cell_count && ids[source] != StringName() && counts[source] > 0) {
+				r_shape.ids[cell] = ids[source];
+				r_shape.counts[cell] = counts[source];
+			} else {
+				r_shape.ids[cell] = StringName();
+				r_shape.counts[cell] = 0;
+			}
+		}
+	}
+}
+
+void ShapedCraftingRecipe::read_grid(const Inventory *grid, int grid_width, Shape &r_shape) {
+	int size = grid->get_size();
+	LocalVector<StringName> ids;
+	LocalVector<int> counts;
+	ids.resize(size);
+	counts.resize(size);
+	for (int i = 0; i < size; i++) {
+		ids[i] = grid->get_slot_item_id(i);
+		counts[i] = grid->get_slot_count(i);
+	}
+	trim_cells(size, grid_width, ids.ptr(), counts.ptr(), r_shape);
+}
+
+bool ShapedCraftingRecipe::matches(const Shape &grid, bool mirrored) const {
+	if (shape.ids.is_empty() || grid.width != shape.width || grid.height != shape.height) {
+		return false;
+	}
+	for (int y = 0; y < shape.height; y++) {
+		for (int x = 0; x < shape.width; x++) {
+			int cell = shape.get_cell(x, y, mirrored);
+			int grid_cell = y * grid.width + x;
+			if (grid.ids[grid_cell] != shape.ids[cell] || grid.counts[grid_cell] < shape.counts[cell]) {
+				return false;
+			}
+		}
+	}
+	return true;
+}
+
+bool ShapedCraftingRecipe::is_symmetric() const {
+	for (int y = 0; y < shape.height; y++) {
+		for (int x = 0; x < shape.width / 2; x++) {
+			int cell = shape.get_cell(x, y, false);
+			int mirrored_cell = shape.get_cell(x, y, true);
+			if (shape.ids[cell] != shape.ids[mirrored_cell] || shape.counts[cell] != shape.counts[mirrored_cell]) {
+				return false;
+			}
+		}
+	}
+	return true;
+}
+
+// The shapeless inputs are the cells of the pattern, so the base recipe's queries see the totals the pattern needs.
+void ShapedCraftingRecipe::compile_inputs() {
+	inputs = pattern;
+	CraftingRecipe::compile_inputs();
+	LocalVector<StringName> ids;
+	LocalVector<int> counts;
+	ids.resize(pattern.size());
+	counts.resize(pattern.size());
+	for (int i = 0; i < pattern.size(); i++) {
+		Ref<Item> cell = pattern[i];
+		if (Item::is_empty_or_null(cell)) {
+			counts[i] = 0;
+		} else {
+			ids[i] = cell->get_id();
+			counts[i] = cell->get_count();
+		}
+	}
+	trim_cells(pattern.size(), width, ids.ptr(), counts.ptr(), shape);
+}
+
+void ShapedCraftingRecipe::add_to_index() {
+	CraftingRecipe::add_to_index();
+	if (shape.ids.is_empty()) {
+		return;
+	}
+	int orientations = mirrorable && !is_symmetric() ? 2 : 1;
+	for (int i = 0; i < orientations; i++) {
+		ShapeEntry entry;
+		entry.hash = shape.hash(i == 1);
+		entry.mirrored = i == 1;
+		LocalVector<ShapeMatch> &list = recipes_by_shape[entry.hash];
+		entry.position = list.size();
+		shape_entries.push_back(entry);
+		ShapeMatch match;
+		match.recipe = Ref<ShapedCraftingRecipe>(this);
+		match.mirrored = entry.mirrored;
+		list.push_back(match);
+	}
+}
+
+void ShapedCraftingRecipe::remove_from_index() {
+	CraftingRecipe::remove_from_index();
+	for (uint32_t i = 0; i < shape_entries.size(); i++) {
+		const ShapeEntry &entry = shape_entries[i];
+		LocalVector<ShapeMatch> *list = recipes_by_shape.getptr(entry.hash);
+		ERR_CONTINUE(list == nullptr || entry.position >= list->size());
+		uint32_t last = list->size() - 1;
+		if (entry.position != last) {
+			ShapeMatch moved = (*list)[last];
+			(*list)[entry.position] = moved;
+			for (uint32_t j = 0; j < moved.recipe->shape_entries.size(); j++) {
+				ShapeEntry &moved_entry = moved.recipe->shape_entries[j];
+				if (moved_entry.hash == entry.hash && moved_entry.mirrored == moved.mirrored) {
+					moved_entry.position = entry.position;
+					break;
+				}
+			}
+		}
+		list->resize(last);
+		if (list->is_empty()) {
+			recipes_by_shape.erase(entry.hash);
+		}
+	}
+	shape_entries.clear();
+}
+
+// Shaped recipes have no tag inputs.
+void ShapedCraftingRecipe::_validate_property(PropertyInfo &p_property) const {
+	if (p_property.name == "tag_inputs") {
+		p_property.usage = PROPERTY_USAGE_NONE;
+	}
+}
+
+TypedArray<Item> ShapedCraftingRecipe::get_pattern() const {
+	TypedArray<Item> output;
+	for (int i = 0; i < pattern.size(); i++) {
+		output.append(pattern[i]);
+	}
+	return output;
+}
+
+void ShapedCraftingRecipe::set_pattern(TypedArray<Item> pattern) {
+	this->pattern.clear();
+	for (int i = 0; i < pattern.size(); i++) {
+		this->pattern.push_back(pattern[i]);
+	}
+	compile_inputs();
+	update_registration();
+}
+
+int ShapedCraftingRecipe::get_width() const {
+	return width;
+}
+
+void ShapedCraftingRecipe::set_width(int width) {
+	ERR_FAIL_COND_MSG(width < 1, "Shaped crafting recipes must be at least 1 cell wide!");
+	this->width = width;
+	compile_inputs();
+	update_registration();
+}
+
+bool ShapedCraftingRecipe::is_mirrorable() const {
+	return mirrorable;
+}
+
+void ShapedCraftingRecipe::set_mirrorable(bool mirrorable) {
+	this->mirrorable = mirrorable;
+	update_registration();
+}
+
+bool ShapedCraftingRecipe::matches_grid(Ref<Inventory> grid, int grid_width) const {
+	ERR_FAIL_NULL_V_MSG(grid, false, "Attempt to use null inventory");
+	ERR_FAIL_COND_V_MSG(grid_width < 1, false, "Grid inventories must be at least 1 slot wide!");
+	Shape grid_shape;
+	read_grid(grid.ptr(), grid_width, grid_shape);
+	return matches(grid_shape, false) || (mirrorable && matches(grid_shape, true));
+}
+
+// Takes each cell of the pattern from the slot it was matched to, rather than from anywhere in the grid.
+Ref<Item> ShapedCraftingRecipe::craft_in_grid(Ref<Inventory> grid, int grid_width) const {
+	ERR_FAIL_NULL_V_MSG(grid, Item::get_empty(), "Attempt to use null inventory");
+	ERR_FAIL_COND_V_MSG(grid_width < 1, Item::get_empty(), "Grid inventories must be at least 1 slot wide!");
+	Shape grid_shape;
+	read_grid(grid.ptr(), grid_width, grid_shape);
+	bool mirrored = false;
+	if (!matches(grid_shape, false)) {
+		if (!mirrorable || !matches(grid_shape, true)) {
+			return Item::get_empty();
+		}
+		mirrored = true;
+	}
+	grid->begin_batch();
+	for (int y = 0; y < shape.height; y++) {
+		for (int x = 0; x < shape.width; x++) {
+			int count = shape.counts[shape.get_cell(x, y, mirrored)];
+			if (count > 0) {
+				grid->take_from_slot(grid_shape.slots[y * grid_shape.width + x], count);
+			}
+		}
+	}
+	grid->commit();
+	if (Item::is_empty_or_null(output)) {
+		return Item::get_empty();
+	}
+	return output->clone();
+}
+
+// The registered shaped recipe matching what is laid out in the grid, found with a single hash lookup.
+Ref<ShapedCraftingRecipe> ShapedCraftingRecipe::find_for_grid(Ref<Inventory> grid, int grid_width) {
+	ERR_FAIL_NULL_V_MSG(grid, Ref<ShapedCraftingRecipe>(), "Attempt to use null inventory");
+	ERR_FAIL_COND_V_MSG(grid_width < 1, Ref<ShapedCraftingRecipe>(), "Grid inventories must be at least 1 slot wide!");
+	Shape grid_shape;
+	read_grid(grid.ptr(), grid_width, grid_shape);
+	if (grid_shape.ids.is_empty()) {
+		return Ref<ShapedCraftingRecipe>();
+	}
+	const LocalVector<ShapeMatch> *list = recipes_by_shape.getptr(grid_shape.hash(false));
+	if (list == nullptr) {
+		return Ref<ShapedCraftingRecipe>();
+	}
+	// Recipes with different shapes can share a hash, so each candidate is still checked.
+	for (uint32_t i = 0; i < list->size(); i++) {
+		const ShapeMatch &match = (*list)[i];
+		if (match.recipe->matches(grid_shape, match.mirrored)) {
+			return match.recipe;
+		}
+	}
+	return Ref<ShapedCraftingRecipe>();
+}
+
+ShapedCraftingRecipe::ShapedCraftingRecipe() {
+	width = 3;
+	mirrorable = false;
+}
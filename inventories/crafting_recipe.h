@@ -2,6 +2,10 @@
 #define CRAFTING_RECIPE_H
 
 #include "core/templates/vector.h"
+#include "core/templates/hash_map.h"
+#include "core/templates/local_vector.h"
+#include "core/templates/hash_set.h"
+#include "core/templates/hashfuncs.h"
 #include "core/variant/typed_array.h"
 #include "core/string/ustring.h"
 #include "core/string/string_name.h"
@@ -16,13 +20,142 @@ class CraftingRecipe : public Resource {
 protected:
     static void _bind_methods();
     Vector<Ref<Item>> inputs;
+    // Inputs merged by id and sorted, rebuilt whenever the inputs are set and on registration.
+    struct CompiledInput {
+        StringName id;
+        int count = 0;
+        bool operator<(const CompiledInput &p_other) const { return id < p_other.id; }
+    };
+    LocalVector<CompiledInput> compiled_inputs;
+    virtual void compile_inputs();
+    // Inputs accepting any registered item with a tag, sorted by tag. Exact inputs are taken first, and whatever
+    // is left of each id is shared between the tag inputs.
+    Dictionary tag_inputs;
+    struct CompiledTagInput {
+        StringName tag;
+        int count = 0;
+        bool operator<(const CompiledTagInput &p_other) const { return tag < p_other.tag; }
+    };
+    LocalVector<CompiledTagInput> compiled_tag_inputs;
+    void compile_tag_inputs();
+    static constexpr int MAX_TAG_INPUTS = 8;
+    // Recipes with more tag inputs are never craftable and can not be registered.
+    bool too_many_tag_inputs = false;
+    // Registered ids carrying any of the input tags, with a bit for each tag input they can go to and the count of
+    // the id exact inputs take first. Rebuilt whenever the item registry changes.
+    struct TagCandidate {
+        StringName id;
+        uint32_t mask = 0;
+        int reserved = 0;
+    };
+    mutable LocalVector<TagCandidate> tag_candidates;
+    mutable uint64_t tag_candidates_generation;
+    void update_tag_candidates() const;
+    static bool can_supply(const int64_t *demands, int tag_count, int64_t *supply_by_mask);
+    bool tags_craftable_in(const Inventory *inventory, int64_t crafts) const;
+    void take_tag_inputs(Inventory *inventory, int64_t crafts) const;
+    // Whether the recipe's inputs are edited as a list of "Input" properties. Subclasses that build the
+    // inputs from something else return false to hide them.
+    virtual bool has_input_list() const { return true; }
     Ref<Item> output;
-    static Vector<Ref<CraftingRecipe>> recipes;
+    // Registered recipes by registry id, in registration order. Registering over an id replaces the recipe in place.
+    static HashMap<StringName, Ref<CraftingRecipe>> recipes;
+    static uint64_t next_recipe_id;
+    StringName registry_id;
+    // Registered recipes by the ids of their inputs and output, kept up to date as recipes are registered,
+    // unregistered or changed. Each recipe remembers where it sits in those lists so it can be removed in O(1).
+    static HashMap<StringName, LocalVector<Ref<CraftingRecipe>>> recipes_by_input;
+    static HashMap<StringName, LocalVector<Ref<CraftingRecipe>>> recipes_by_output;
+    // Registered recipes by the tags of their tag inputs.
+    static HashMap<StringName, LocalVector<Ref<CraftingRecipe>>> recipes_by_tag;
+    enum IndexKind {
+        INDEX_INPUT,
+        INDEX_OUTPUT,
+        INDEX_TAG,
+    };
+    static HashMap<StringName, LocalVector<Ref<CraftingRecipe>>> &get_index(IndexKind kind);
+    struct IndexEntry {
+        StringName id;
+        IndexKind kind = INDEX_INPUT;
+        uint32_t position = 0;
+    };
+    void add_index_entry(IndexKind kind, const StringName &id);
+    LocalVector<IndexEntry> index_entries;
+    virtual void add_to_index();
+    virtual void remove_from_index();
+    // Updates the indices after a registered recipe changed, and lets every cache know.
+    void update_registration();
+    static uint64_t generation;
+    static uint64_t index_generation;
+    static void update_index();
+    static void push_ready(LocalVector<LocalVector<const CraftingRecipe *>> &ready, const CraftingRecipe *recipe, int depth);
+    static void release_users(const HashMap<StringName, LocalVector<const CraftingRecipe *>> &users, HashMap<const CraftingRecipe *, int> &waiting, HashMap<const CraftingRecipe *, int> &recipe_depths, LocalVector<LocalVector<const CraftingRecipe *>> &ready, const StringName &id, int depth);
+
+    // Registered recipes by the id of their output, ordered by how many crafting steps they need from
+    // uncraftable items at best. Items only craftable through a cycle, like ingots from blocks made of ingots,
+    // count as uncraftable there. Rebuilt on demand after recipes change.
+    struct Producer {
+        Ref<CraftingRecipe> recipe;
+        int depth = 0;
+        int order = 0;
+        bool operator<(const Producer &p_other) const { return depth == p_other.depth ? order < p_other.order : depth < p_other.depth; }
+    };
+    static HashMap<StringName, LocalVector<Producer>> producers;
+    // Crafting depth of each output id, 0 for ids only craftable through a cycle.
+    static HashMap<StringName, int> craft_depths;
+
+    struct PlanStep {
+        Ref<CraftingRecipe> recipe;
+        int64_t count = 0;
+    };
+    struct PlanUndo {
+        StringName id;
+        int64_t previous = 0;
+        bool existed = false;
+        // Identifies the stock after this change, so a rolled back stock is recognized as the same one.
+        uint64_t version = 0;
+    };
+    struct PlanFailure {
+        int64_t amount = 0;
+        uint64_t version = 0;
+    };
+    struct PlanState {
+        const Inventory *inventory = nullptr;
+        // Counts left once earlier steps of the plan took or made items, filled in from the inventory on first use.
+        HashMap<StringName, int64_t> stock;
+        LocalVector<PlanUndo> undo;
+        LocalVector<PlanStep> steps;
+        HashMap<StringName, int64_t> missing;
+        HashSet<StringName> visiting;
+        uint64_t next_version = 1;
+        // Requests that could not be planned from the stock with the given version. Only failures that no cycle cut
+        // short are kept, as those do not depend on the path that led to them.
+        HashMap<StringName, LocalVector<PlanFailure>> failures;
+        uint32_t cycle_cuts = 0;
+        uint64_t get_version() const;
+        bool has_failed(const StringName &id, int64_t amount) const;
+        int64_t get_stock(const StringName &id) const;
+        void set_stock(const StringName &id, int64_t count);
+        void rollback(uint32_t undo_mark, uint32_t step_mark);
+    };
+    static bool plan_request(PlanState &state, const StringName &id, int64_t amount, bool report);
+    static bool plan_recipe(PlanState &state, const Ref<CraftingRecipe> &recipe, const StringName &id, int64_t amount, bool report);
+
+    struct CraftableBatch {
+        LocalVector<const CraftingRecipe *> recipes;
+        LocalVector<const Inventory *> inventories;
+        LocalVector<LocalVector<int>> craftable;
+    };
+    static void check_craftable_batch(void *p_batch, uint32_t p_index);
+    bool is_craftable_in(const Inventory *inventory) const;
 
 public:
     TypedArray<Item> get_inputs() const;
     Ref<Item> get_output() const;
     void set_output(Ref<Item>);
+    Dictionary get_tag_inputs() const;
+    void set_tag_inputs(Dictionary tag_inputs);
+    StringName get_registry_id() const;
 
     void _get_property_list(List<PropertyInfo> *r_props) const;
     bool _get(const StringName &p_property, Variant &r_value) const;
@@ -31,10 +164,23 @@ public:
     bool craftable(Ref<Inventory> inventory) const;
     Ref<Item> craft(Ref<Inventory> inventory) const;
     bool take_inputs(Ref<Inventory> inventory) const;
+    int max_craftable(Ref<Inventory> inventory) const;
+    TypedArray<Item> craft_n(Ref<Inventory> inventory, int count) const;
 
     static TypedArray<CraftingRecipe> all_craftable(Ref<Inventory> inventory);
+    static Array all_craftable_batch(TypedArray<Inventory> inventories);
     static TypedArray<CraftingRecipe> all_registered();
-    static void register_recipe(Ref<CraftingRecipe> recipe);
+    static Dictionary plan(Ref<Inventory> inventory, StringName id, int count);
+    static StringName register_recipe(Ref<CraftingRecipe> recipe, StringName id = StringName());
+    static void unregister_recipe(StringName id);
+    static void unregister_all();
+    static Ref<CraftingRecipe> get_by_id(StringName id);
+    static TypedArray<CraftingRecipe> find_by_input(StringName id);
+    static TypedArray<CraftingRecipe> find_by_output(StringName id);
+    static const HashMap<StringName, Ref<CraftingRecipe>> &get_registered();
+    static const LocalVector<Ref<CraftingRecipe>> *get_recipes_using(const StringName &id);
+    static const LocalVector<Ref<CraftingRecipe>> *get_recipes_using_tag(const StringName &tag);
+    _FORCE_INLINE_ static uint64_t get_generation() { return generation; }
 
     static void unregister_hook();
 
@@ -42,4 +188,65 @@ public:
     ~CraftingRecipe();
 };
 
+// A recipe whose inputs have to be laid out in a grid inventory, such as a 3x3 workbench. Empty rows and columns
+// around the pattern are ignored, so it can be placed anywhere on a large enough grid.
+class ShapedCraftingRecipe : public CraftingRecipe {
+    GDCLASS(ShapedCraftingRecipe, CraftingRecipe);
+
+protected:
+    static void _bind_methods();
+    Vector<Ref<Item>> pattern;
+    int width;
+    bool mirrorable;
+    // The pattern with empty rows and columns trimmed, row by row. Empty cells have an empty id.
+    struct Shape {
+        int width = 0;
+        int height = 0;
+        LocalVector<StringName> ids;
+        LocalVector<int> counts;
+        // The index each cell was read from, which for grids is its slot.
+        LocalVector<int> slots;
+        int get_cell(int x, int y, bool mirrored) const { return y * width + (mirrored ? width - 1 - x : x); }
+        uint32_t hash(bool mirrored) const;
+    };
+    Shape shape;
+    static void trim_cells(int cell_count, int cells_width, const StringName *ids, const int *counts, Shape &r_shape);
+    static void read_grid(const Inventory *grid, int grid_width, Shape &r_shape);
+    bool matches(const Shape &grid, bool mirrored) const;
+    bool is_symmetric() const;
+
+    // Registered shaped recipes by the hash of their shape, and of their mirrored shape for mirrorable recipes.
+    struct ShapeMatch {
+        Ref<ShapedCraftingRecipe> recipe;
+        bool mirrored = false;
+    };
+    static HashMap<uint32_t, LocalVector<ShapeMatch>> recipes_by_shape;
+    struct ShapeEntry {
+        uint32_t hash = 0;
+        bool mirrored = false;
+        uint32_t position = 0;
+    };
+    LocalVector<ShapeEntry> shape_entries;
+
+    void _validate_property(PropertyInfo &p_property) const;
+    virtual void compile_inputs() override;
+    virtual bool has_input_list() const override { return false; }
+    virtual void add_to_index() override;
+    virtual void remove_from_index() override;
+
+public:
+    TypedArray<Item> get_pattern() const;
+    void set_pattern(TypedArray<Item> pattern);
+    int get_width() const;
+    void set_width(int width);
+    bool is_mirrorable() const;
+    void set_mirrorable(bool mirrorable);
+
+    bool matches_grid(Ref<Inventory> grid, int grid_width) const;
+    Ref<Item> craft_in_grid(Ref<Inventory> grid, int grid_width) const;
+    static Ref<ShapedCraftingRecipe> find_for_grid(Ref<Inventory> grid, int grid_width);
+
+    ShapedCraftingRecipe();
+};
+
 #endif
@@ -2,86 +2,350 @@
 #include "core/object/object.h"
 #include "core/variant/typed_array.h"
 #include "item.h"
+#include "crafting_recipe.h"
 
 void Inventory::_bind_methods() {
     ClassDB::bind_method(D_METHOD("get_size"), &Inventory::get_size);
     ClassDB::bind_method(D_METHOD("set_size", "size"), &Inventory::set_size);
+    ClassDB::bind_method(D_METHOD("is_compact"), &Inventory::is_compact);
+    ClassDB::bind_method(D_METHOD("set_compact", "compact"), &Inventory::set_compact);
     ClassDB::bind_method(D_METHOD("get_items"), &Inventory::get_items);
     ClassDB::bind_method(D_METHOD("set_items", "items"), &Inventory::set_items);
+    ClassDB::bind_method(D_METHOD("get_items_packed"), &Inventory::get_items_packed);
+    ClassDB::bind_method(D_METHOD("set_items_packed", "ids", "counts"), &Inventory::set_items_packed);
     ClassDB::bind_method(D_METHOD("set_slot", "slot_id" "item"), &Inventory::set_slot);
     ClassDB::bind_method(D_METHOD("has_item", "id"), &Inventory::has_item);
     ClassDB::bind_method(D_METHOD("take_slot", "slot_id"), &Inventory::take_slot);
+    ClassDB::bind_method(D_METHOD("take_from_slot", "slot_id", "count"), &Inventory::take_from_slot);
+    ClassDB::bind_method(D_METHOD("get_slot_item_id", "slot_id"), &Inventory::get_slot_item_id);
+    ClassDB::bind_method(D_METHOD("get_slot_count", "slot_id"), &Inventory::get_slot_count);
     ClassDB::bind_method(D_METHOD("peek_slot", "slot_id"), &Inventory::peek_slot);
     ClassDB::bind_method(D_METHOD("take_item", "id", "count"), &Inventory::take_item);
     ClassDB::bind_method(D_METHOD("add_item", "item"), &Inventory::add_item);
+    ClassDB::bind_method(D_METHOD("add_item_id", "id", "count"), &Inventory::add_item_id);
     ClassDB::bind_method(D_METHOD("swap_item", "slot_id", "item"), &Inventory::swap_item);
     ClassDB::bind_method(D_METHOD("get_item_count", "id"), &Inventory::get_item_count);
+    ClassDB::bind_method(D_METHOD("get_item_slots", "id"), &Inventory::get_item_slots);
     ClassDB::bind_method(D_METHOD("use_slot", "slot_id", "owner"), &Inventory::use_slot);
+    ClassDB::bind_method(D_METHOD("begin_batch"), &Inventory::begin_batch);
+    ClassDB::bind_method(D_METHOD("commit"), &Inventory::commit);
+    ClassDB::bind_method(D_METHOD("batch", "callable"), &Inventory::batch);
+    ClassDB::bind_method(D_METHOD("is_tracking_craftable"), &Inventory::is_tracking_craftable);
+    ClassDB::bind_method(D_METHOD("set_track_craftable", "track_craftable"), &Inventory::set_track_craftable);
+    ClassDB::bind_method(D_METHOD("get_craftable_recipes"), &Inventory::get_craftable_recipes);
 
     ADD_PROPERTY(PropertyInfo(Variant::INT, "size"), "set_size", "get_size");
+    ADD_PROPERTY(PropertyInfo(Variant::BOOL, "compact"), "set_compact", "is_compact");
     ADD_PROPERTY(PropertyInfo(Variant::ARRAY, "items", PROPERTY_HINT_ARRAY_TYPE, "Item"), "set_items", "get_items");
+    ADD_PROPERTY(PropertyInfo(Variant::BOOL, "track_craftable"), "set_track_craftable", "is_tracking_craftable");
     ADD_SIGNAL(MethodInfo("item_changed", PropertyInfo(Variant::INT, "slot_id"), PropertyInfo(Variant::OBJECT, "new_item", PROPERTY_HINT_RESOURCE_TYPE, "Item")));
+    ADD_SIGNAL(MethodInfo("items_changed", PropertyInfo(Variant::PACKED_INT32_ARRAY, "slot_ids")));
+    ADD_SIGNAL(MethodInfo("craftable_recipes_changed", PropertyInfo(Variant::ARRAY, "added", PROPERTY_HINT_ARRAY_TYPE, "CraftingRecipe"), PropertyInfo(Variant::ARRAY, "removed", PROPERTY_HINT_ARRAY_TYPE, "CraftingRecipe")));
+}
+
+// Slot sets are sorted vectors, kept sorted by inserting and erasing at the position found by a binary search.
+static uint32_t find_slot(const LocalVector<int> &slots, int slot_id) {
+    uint32_t low = 0;
+    uint32_t high = slots.size();
+    while (low < high) {
+        uint32_t middle = (low + high) / 2;
+        if (slots[middle] < slot_id) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+    return low;
+}
+
+static void insert_slot(LocalVector<int> &slots, int slot_id) {
+    uint32_t position = find_slot(slots, slot_id);
+    if (position == slots.size() || slots[position] != slot_id) {
+        slots.insert(position, slot_id);
+    }
+}
+
+static void erase_slot(LocalVector<int> &slots, int slot_id) {
+    uint32_t position = find_slot(slots, slot_id);
+    if (position < slots.size() && slots[position] == slot_id) {
+        slots.remove_at(position);
+    }
+}
+
+void Inventory::set_slot_free(int slot_id, bool free) {
+    uint64_t bit = uint64_t(1) << (slot_id & 63);
+    uint64_t &word = free_slots[slot_id >> 6];
+    if (free && !(word & bit)) {
+        word |= bit;
+        free_count++;
+        free_hint = MIN(free_hint, (uint32_t)(slot_id >> 6));
+    } else if (!free && (word & bit)) {
+        word &= ~bit;
+        free_count--;
+    }
+}
+
+void Inventory::clear_free_slots() {
+    for (uint32_t i = 0; i < free_slots.size(); i++) {
+        free_slots[i] = 0;
+    }
+    free_count = 0;
+    free_hint = 0;
+}
+
+// The lowest empty slot, or -1 if every slot is in use.
+int Inventory::first_free_slot() {
+    if (free_count == 0) {
+        return -1;
+    }
+    while (free_hint < free_slots.size() && free_slots[free_hint] == 0) {
+        free_hint++;
+    }
+    ERR_FAIL_COND_V(free_hint >= free_slots.size(), -1);
+    uint64_t word = free_slots[free_hint];
+    int bit = 0;
+    while (!(word & 1)) {
+        word >>= 1;
+        bit++;
+    }
+    return (free_hint << 6) + bit;
 }
 
 void Inventory::add_to_cache(StringName id, int diff) {
-    if (cache.has(id)) {
-        cache[id] = cache[id] + diff;
-    } else {
-        cache[id] = diff;
+    if (track_craftable) {
+        craftable_dirty.insert(id);
     }
-    if (cache[id] < 0) {
-        ERR_PRINT("Inventory item count cache is invalid!");
-        invalidate_cache();
+    ItemIndex &index = cache[id];
+    index.count += diff;
+    // Counts are only ever removed as they were recorded in the slot shadow, so they cannot go negative.
+    DEV_ASSERT(index.count >= 0);
+    if (index.count == 0 && index.slots.is_empty()) {
+        cache.erase(id);
     }
 }
 
 void Inventory::invalidate_cache() {
-    cache.clear();
-    for (int i = 0; i < (int)items.size(); i++) {
-        Ref<Item> item = items[i];
-        if (!Item::is_empty_or_null(item)) {
-            add_to_cache(item->get_id(), item->get_count());
+    // Ids that are gone after reindexing changed count too, so recipes using them are checked again.
+    if (track_craftable) {
+        for (const KeyValue<StringName, ItemIndex> &E : cache) {
+            craftable_dirty.insert(E.key);
         }
     }
+    cache.clear();
+    clear_free_slots();
+    for (int i = 0; i < size; i++) {
+        index_slot(i, StringName(slot_ids[i]), slot_counts[i]);
+    }
+}
+
+void Inventory::index_slot(int slot_id, const StringName &id, int count) {
+    if (id == StringName() || count <= 0) {
+        slot_ids[slot_id] = StringName();
+        slot_counts[slot_id] = 0;
+        set_slot_free(slot_id, true);
+        return;
+    }
+    slot_ids[slot_id] = id;
+    slot_counts[slot_id] = count;
+    ItemIndex &index = cache[id];
+    insert_slot(index.slots, slot_id);
+    if (count < ItemRegistry::get_singleton()->get_stack_size(id)) {
+        insert_slot(index.partial, slot_id);
+    }
+    add_to_cache(id, count);
+}
+
+void Inventory::index_slot(int slot_id, Ref<Item> item) {
+    if (Item::is_empty_or_null(item)) {
+        index_slot(slot_id, StringName(), 0);
+    } else {
+        index_slot(slot_id, item->get_id(), item->get_count());
+    }
+}
+
+void Inventory::unindex_slot(int slot_id) {
+    StringName id = slot_ids[slot_id];
+    if (id == StringName()) {
+        set_slot_free(slot_id, false);
+        return;
+    }
+    ItemIndex *index = cache.getptr(id);
+    if (index != nullptr) {
+        erase_slot(index->slots, slot_id);
+        erase_slot(index->partial, slot_id);
+    }
+    add_to_cache(id, -slot_counts[slot_id]);
+}
+
+void Inventory::reindex_slot(int slot_id) {
+    // Only an item handed out by peek_slot can have been changed in place. The arrays still hold what the
+    // slot was indexed with, so they can be swapped for the item's contents directly.
+    if (compact || items[slot_id].is_null()) {
+        return;
+    }
+    unindex_slot(slot_id);
+    index_slot(slot_id, items[slot_id]);
 }
 
 void Inventory::update_slot(int slot_id) {
-    if (slot_id < (int)items.size()) {
-        invalidate_cache();
-        emit_signal("item_changed", slot_id, peek_slot(slot_id)->clone());
+    if (slot_id >= 0 && slot_id < size) {
+        reindex_slot(slot_id);
+        slot_changed(slot_id);
     }
 }
 
-void Inventory::set_slot(int slot_id, Ref<Item> item) {
-    if (slot_id < (int)items.size()) {
-        Ref<Item> backup = peek_slot(slot_id);
-        if (backup.is_valid()) {
-            backup = backup->clone();
+void Inventory::slot_changed(int slot_id) {
+    if (batch_depth > 0) {
+        batch_slots.insert(slot_id);
+    } else {
+        emit_signal("item_changed", slot_id, peek_slot(slot_id));
+        update_craftable();
+    }
+}
+
+void Inventory::begin_batch() {
+    batch_depth++;
+}
+
+void Inventory::commit() {
+    ERR_FAIL_COND_MSG(batch_depth <= 0, "Attempt to commit an inventory that is not in a batch!");
+    batch_depth--;
+    if (batch_depth > 0 || batch_slots.is_empty()) {
+        return;
+    }
+    // Slots removed by shrinking the inventory after they changed are not reported.
+    PackedInt32Array changed;
+    for (RBSet<int>::Element *E = batch_slots.front(); E && E->get() < size; E = E->next()) {
+        changed.push_back(E->get());
+    }
+    batch_slots.clear();
+    // A batch that changed a single slot reports it like an unbatched change.
+    if (changed.size() == 1) {
+        emit_signal("item_changed", changed[0], peek_slot(changed[0]));
+    } else if (!changed.is_empty()) {
+        emit_signal("items_changed", changed);
+    }
+    update_craftable();
+}
+
+bool Inventory::is_tracking_craftable() const {
+    return track_craftable;
+}
+
+void Inventory::set_track_craftable(bool track_craftable) {
+    this->track_craftable = track_craftable;
+    craftable.clear();
+    craftable_dirty.clear();
+    // Forces a full check on the next update.
+    craftable_generation = 0;
+    craftable_item_generation = 0;
+    update_craftable();
+}
+
+TypedArray<CraftingRecipe> Inventory::get_craftable_recipes() {
+    TypedArray<CraftingRecipe> output;
+    ERR_FAIL_COND_V_MSG(!track_craftable, output, "Craftable recipes are only known for inventories with track_craftable enabled!");
+    update_craftable();
+    for (const KeyValue<uint64_t, Ref<CraftingRecipe>> &E : craftable) {
+        output.append(E.value);
+    }
+    return output;
+}
+
+void Inventory::update_craftable() {
+    if (!track_craftable || batch_depth > 0) {
+        return;
+    }
+    TypedArray<CraftingRecipe> added;
+    TypedArray<CraftingRecipe> removed;
+    // Registering items can change which items carry the tags a recipe takes, so that needs a full check too.
+    if (craftable_generation != CraftingRecipe::get_generation() || craftable_item_generation != ItemRegistry::get_singleton()->get_generation()) {
+        HashMap<uint64_t, Ref<CraftingRecipe>> old_craftable = craftable;
+        craftable.clear();
+        for (const KeyValue<StringName, Ref<CraftingRecipe>> &E : CraftingRecipe::get_registered()) {
+            const Ref<CraftingRecipe> &recipe = E.value;
+            if (recipe->craftable(this)) {
+                craftable[recipe->get_instance_id()] = recipe;
+                if (!old_craftable.erase(recipe->get_instance_id())) {
+                    added.append(recipe);
+                }
+            }
         }
-        items[slot_id] = item;
-        if (!Item::is_empty_or_null(item)) {
-            add_to_cache(item->get_id(), item->get_count());
-        } 
-        if (!Item::is_empty_or_null(backup)) {
-            add_to_cache(backup->get_id(), -backup->get_count());
+        for (const KeyValue<uint64_t, Ref<CraftingRecipe>> &E : old_craftable) {
+            removed.append(E.value);
         }
-        emit_signal("item_changed", slot_id, item);
+        craftable_generation = CraftingRecipe::get_generation();
+        craftable_item_generation = ItemRegistry::get_singleton()->get_generation();
+    } else {
+        // Checked recipes are added to or removed from craftable, so a recipe found again is skipped.
+        LocalVector<const LocalVector<Ref<CraftingRecipe>> *> dirty_recipes;
+        for (const StringName &id : craftable_dirty) {
+            dirty_recipes.push_back(CraftingRecipe::get_recipes_using(id));
+            const LocalVector<StringName> *tags = ItemRegistry::get_singleton()->get_item_tags(id);
+            if (tags != nullptr) {
+                for (uint32_t i = 0; i < tags->size(); i++) {
+                    dirty_recipes.push_back(CraftingRecipe::get_recipes_using_tag((*tags)[i]));
+                }
+            }
+        }
+        for (uint32_t i = 0; i < dirty_recipes.size(); i++) {
+            const LocalVector<Ref<CraftingRecipe>> *recipes = dirty_recipes[i];
+            if (recipes == nullptr) {
+                continue;
+            }
+            for (int j = 0; j < (int)recipes->size(); j++) {
+                Ref<CraftingRecipe> recipe = (*recipes)[j];
+                bool was_craftable = craftable.has(recipe->get_instance_id());
+                if (recipe->craftable(this) == was_craftable) {
+                    continue;
+                }
+                if (was_craftable) {
+                    craftable.erase(recipe->get_instance_id());
+                    removed.append(recipe);
+                } else {
+                    craftable[recipe->get_instance_id()] = recipe;
+                    added.append(recipe);
+                }
+            }
+        }
+    }
+    craftable_dirty.clear();
+    if (!added.is_empty() || !removed.is_empty()) {
+        emit_signal("craftable_recipes_changed", added, removed);
+    }
+}
+
+Variant Inventory::batch(Callable callable) {
+    begin_batch();
+    Variant result = callable.callv(Array());
+    commit();
+    return result;
+}
+
+void Inventory::set_slot(int slot_id, Ref<Item> item) {
+    if (slot_id >= 0 && slot_id < size) {
+        unindex_slot(slot_id);
+        if (!compact) {
+            items[slot_id] = item;
+        }
+        index_slot(slot_id, item);
+        slot_changed(slot_id);
     }
 }
 
 ItemUseResult Inventory::use_slot(int slot_id, Node *owner) {
-    if (slot_id < (int)items.size()) {
+    if (slot_id >= 0 && slot_id < size) {
         Ref<Item> item = peek_slot(slot_id);
         if (!Item::is_empty_or_null(item)) {
-            Ref<Item> backup = item->clone();
             ItemUseResult result = item->use(owner);
-            if (item->get_id() != backup->get_id()) {
-                add_to_cache(backup->get_id(), -backup->get_count());
-                add_to_cache(item->get_id(), item->get_count());
+            if (compact) {
+                // The item was made just for this call, so its new contents have to be written back.
+                unindex_slot(slot_id);
+                index_slot(slot_id, item);
             } else {
-                add_to_cache(item->get_id(), item->get_count() - backup->get_count());
+                reindex_slot(slot_id);
             }
-            emit_signal("item_changed", slot_id, item);
+            slot_changed(slot_id);
             return result;
         }
     }
@@ -93,31 +357,116 @@ int Inventory::get_size() const {
 }
 
 void Inventory::set_size(int size) {
-    for (int i = size; i < (int)items.size();) {
+    ERR_FAIL_COND_MSG(size < 0, "Inventory size cannot be negative!");
+    begin_batch();
+    for (int i = size; i < this->size; i++) {
         set_slot(i, Ref<Item>(nullptr));
+        set_slot_free(i, false);
+    }
+    int old_size = this->size;
+    if (!compact) {
+        items.resize(size);
+    }
+    slot_ids.resize(size);
+    slot_counts.resize(size);
+    uint32_t old_words = free_slots.size();
+    free_slots.resize((size + 63) / 64);
+    for (uint32_t i = old_words; i < free_slots.size(); i++) {
+        free_slots[i] = 0;
+    }
+    free_hint = MIN(free_hint, free_slots.size());
+    for (int i = old_size; i < size; i++) {
+        slot_ids[i] = StringName();
+        slot_counts[i] = 0;
+        set_slot_free(i, true);
     }
-    items.resize(size);
     this->size = size;
+    commit();
+}
+
+bool Inventory::is_compact() const {
+    return compact;
+}
+
+void Inventory::set_compact(bool compact) {
+    if (compact) {
+        items.clear();
+    } else if (this->compact) {
+        items.resize(size);
+    }
+    this->compact = compact;
 }
 
 TypedArray<Item> Inventory::get_items() const {
     TypedArray<Item> output;
-    for (int i = 0; i < (int)items.size(); i++) {
+    for (int i = 0; i < size; i++) {
         output.append(peek_slot(i));
     }
     return output;
 }
 
 void Inventory::set_items(TypedArray<Item> items) {
-    this->items.clear();
-    this->items.reserve(size);
-    for (int i = 0; i < size && i < (int)items.size(); i++) {
-        this->items.push_back((Ref<Item>)items[i]);
+    for (int i = 0; i < size; i++) {
+        Ref<Item> item = i < items.size() ? (Ref<Item>)items[i] : Ref<Item>(nullptr);
+        if (!compact) {
+            this->items[i] = item;
+        }
+        if (Item::is_empty_or_null(item)) {
+            slot_ids[i] = StringName();
+            slot_counts[i] = 0;
+        } else {
+            slot_ids[i] = item->get_id();
+            slot_counts[i] = item->get_count();
+        }
     }
+    reload_slots();
+}
+
+Dictionary Inventory::get_items_packed() const {
+    PackedStringArray ids;
+    PackedInt32Array counts;
+    ids.resize(size);
+    counts.resize(size);
+    String *ids_ptr = ids.ptrw();
+    int32_t *counts_ptr = counts.ptrw();
+    String empty_id = "empty";
+    for (int i = 0; i < size; i++) {
+        ids_ptr[i] = slot_ids[i] == StringName() ? empty_id : String(slot_ids[i]);
+        counts_ptr[i] = slot_counts[i];
+    }
+    Dictionary output;
+    output["ids"] = ids;
+    output["counts"] = counts;
+    return output;
+}
+
+void Inventory::set_items_packed(PackedStringArray ids, PackedInt32Array counts) {
+    ERR_FAIL_COND_MSG(ids.size() != counts.size(), "Packed item ids and counts must have the same size!");
+    const String *ids_ptr = ids.ptr();
+    const int32_t *counts_ptr = counts.ptr();
+    for (int i = 0; i < size; i++) {
+        if (!compact) {
+            items[i] = Ref<Item>(nullptr);
+        }
+        if (i < ids.size() && counts_ptr[i] > 0 && ids_ptr[i] != "empty") {
+            slot_ids[i] = ids_ptr[i];
+            slot_counts[i] = counts_ptr[i];
+        } else {
+            slot_ids[i] = StringName();
+            slot_counts[i] = 0;
+        }
+    }
+    reload_slots();
+}
+
+// Rebuilds the index after the slot arrays were replaced wholesale, and reports every slot as changed.
+void Inventory::reload_slots() {
     invalidate_cache();
+    begin_batch();
     for (int i = 0; i < size; i++) {
-        emit_signal("item_changed", i, (this->items[i]));
+        slot_changed(i);
     }
+    commit();
 }
 
 bool Inventory::has_item(StringName id) const {
@@ -125,118 +474,207 @@ bool Inventory::has_item(StringName id) const {
 }
 
 Ref<Item> Inventory::take_slot(int slot_id) {
-    if ((int)items.size() < slot_id) {
-        return memnew(Item);
+    if (slot_id < 0 || size <= slot_id || slot_ids[slot_id] == StringName()) {
+        return Item::get_empty();
     } else {
-        Ref<Item> item = items[slot_id];
-        if (Item::is_empty_or_null(item)) {
-            return memnew(Item);
-        } else {
-            set_slot(slot_id, Ref<Item>(nullptr));
-            return item;
-        }
+        Ref<Item> item = peek_slot(slot_id);
+        set_slot(slot_id, Ref<Item>(nullptr));
+        return item;
+    }
+}
+
+// Takes up to count items out of a slot, leaving the rest in it.
+Ref<Item> Inventory::take_from_slot(int slot_id, int count) {
+    if (slot_id < 0 || size <= slot_id || slot_ids[slot_id] == StringName() || count <= 0) {
+        return Item::get_empty();
+    }
+    StringName id = slot_ids[slot_id];
+    int slot_count = slot_counts[slot_id];
+    if (count >= slot_count) {
+        set_slot(slot_id, Ref<Item>(nullptr));
+        return memnew(Item(id, slot_count));
+    }
+    set_slot_count(slot_id, slot_count - count);
+    return memnew(Item(id, count));
+}
+
+// The id and count of a slot without creating an Item. Empty and out-of-range slots have an empty id and a count of 0.
+StringName Inventory::get_slot_item_id(int slot_id) const {
+    if (slot_id < 0 || size <= slot_id) {
+        return StringName();
+    }
+    return slot_ids[slot_id];
+}
+
+int Inventory::get_slot_count(int slot_id) const {
+    if (slot_id < 0 || size <= slot_id) {
+        return 0;
     }
+    return slot_counts[slot_id];
 }
 
 Ref<Item> Inventory::peek_slot(int slot_id) const {
-    if ((int)items.size() < slot_id) {
-        return memnew(Item);
-    } else {
-        Ref<Item> item = items[slot_id];
-        if (item.is_null()) {
-            return memnew(Item);
-        } else {
-            return item;
-        }
+    if (slot_id < 0 || size <= slot_id) {
+        return Item::get_empty();
     }
+    if (!compact && items[slot_id].is_valid()) {
+        return items[slot_id];
+    }
+    if (slot_ids[slot_id] == StringName()) {
+        return Item::get_empty();
+    }
+    Ref<Item> item = memnew(Item(slot_ids[slot_id], slot_counts[slot_id]));
+    if (!compact) {
+        items[slot_id] = item;
+    }
+    return item;
 }
 
 Ref<Item> Inventory::take_item(StringName id, int count) {
-    Ref<Item> output = Ref<Item>(memnew(Item(id, 0)));
-    for (int i = 0; i < (int)items.size(); i++) {
-        Ref<Item> item = peek_slot(i);
-        if (!Item::is_empty_or_null(item) && item->get_id() == id) {
-            int output_new_count = output->get_count() + item->get_count();
-            if (output_new_count > count) {
-                int item_new_count = output_new_count - count;
-                item->set_count(item_new_count);
-                output->set_count(count);
-                set_slot(i, item);
-                break;
-            }
-            set_slot(i, Ref<Item>(nullptr));
-            output->set_count(output_new_count);
+    int taken = 0;
+    begin_batch();
+    while (taken < count) {
+        // Emptied slots leave the index, so the first slot left is always the next one to take from.
+        ItemIndex *index = cache.getptr(id);
+        if (index == nullptr || index->slots.is_empty()) {
+            break;
+        }
+        int slot_id = index->slots[0];
+        int slot_count = slot_counts[slot_id];
+        if (taken + slot_count > count) {
+            set_slot_count(slot_id, taken + slot_count - count);
+            taken = count;
+        } else {
+            set_slot(slot_id, Ref<Item>(nullptr));
+            taken += slot_count;
         }
     }
-    return output;
+    commit();
+    return memnew(Item(id, taken));
+}
+
+void Inventory::set_slot_count(int slot_id, int count) {
+    // Nothing outside the inventory can see an item only it holds, so that item can be changed in place. Slots can
+    // hold more than a stack, which Item::set_count would clamp, so those counts only go in the arrays.
+    Item *item = compact ? nullptr : items[slot_id].ptr();
+    if (item != nullptr && item->get_reference_count() == 1 && !item->is_read_only() && !item->is_empty() &&
+            count > 0 && count <= ItemRegistry::get_singleton()->get_stack_size(slot_ids[slot_id])) {
+        item->set_count(count);
+        reindex_slot(slot_id);
+        slot_changed(slot_id);
+        return;
+    }
+    // Any other item keeps what it was handed out with, and the slot makes a new one from the arrays when read.
+    if (!compact) {
+        items[slot_id] = Ref<Item>(nullptr);
+    }
+    unindex_slot(slot_id);
+    index_slot(slot_id, StringName(slot_ids[slot_id]), count);
+    slot_changed(slot_id);
+}
+
+int Inventory::merge_into_slot(int slot_id, Ref<Item> item, int stack_size) {
+    int my_new_count = slot_counts[slot_id] + item->get_count();
+    int their_new_count = 0;
+    if (my_new_count > stack_size) {
+        their_new_count = my_new_count - stack_size;
+        my_new_count = stack_size;
+    }
+    if (my_new_count != slot_counts[slot_id]) {
+        set_slot_count(slot_id, my_new_count);
+    }
+    item->set_count(their_new_count);
+    return their_new_count;
 }
 
 int Inventory::add_slot(int slot_id, Ref<Item> item) {
-    if ((int)items.size() <= slot_id) {
+    if (slot_id < 0 || size <= slot_id) {
         return false;
     }
     if (Item::is_empty_or_null(item)) {
         return 0;
     }
-    int stack_size = item->get_data()->get_stack_size();
-    Ref<Item> my_item = peek_slot(slot_id);
-    if (Item::is_empty_or_null(my_item)) {
+    if (slot_ids[slot_id] == StringName()) {
         set_slot(slot_id, item);
         return 0;
-    } else {
-        my_item = my_item->clone();
-    }
-    if (my_item->is_equal_type(item)) {
-        int my_count = my_item->get_count();
-        int their_count = item->get_count();
-        int their_new_count = 0;
-        int my_new_count = my_count + their_count;
-        if (my_new_count > stack_size) {
-            their_new_count = my_new_count - stack_size;
-            my_new_count = stack_size;
-        }
-        item->set_count(their_new_count);
-        my_item->set_count(my_new_count);
-        set_slot(slot_id, my_item);
+    }
+    if (slot_ids[slot_id] == item->get_id()) {
+        return merge_into_slot(slot_id, item, item->get_data()->get_stack_size());
     }
     return item->get_count();
 }
 
+// Adds count to the slots holding part of a stack of the item. Returns how many did not fit.
+int Inventory::top_up_partial_slots(const StringName &id, int count, int stack_size) {
+    ItemIndex *index = cache.getptr(id);
+    if (index == nullptr) {
+        return count;
+    }
+    // Topping up a slot can fill its stack and drop it from the set, so walk a copy.
+    LocalVector<int> candidates = index->partial;
+    for (int i = 0; i < (int)candidates.size() && count > 0; i++) {
+        int added = MIN(count, stack_size - slot_counts[candidates[i]]);
+        if (added > 0) {
+            set_slot_count(candidates[i], slot_counts[candidates[i]] + added);
+            count -= added;
+        }
+    }
+    return count;
+}
+
+// Puts count of the item in free slots, one stack per slot. Returns how many did not fit.
+int Inventory::fill_free_slots(const StringName &id, int count, int stack_size) {
+    while (count > 0) {
+        int slot_id = first_free_slot();
+        if (slot_id < 0) {
+            break;
+        }
+        int added = MIN(count, stack_size);
+        unindex_slot(slot_id);
+        if (!compact) {
+            items[slot_id] = Ref<Item>(nullptr);
+        }
+        index_slot(slot_id, id, added);
+        slot_changed(slot_id);
+        count -= added;
+    }
+    return count;
+}
+
+// The item is left holding whatever did not fit, which is also returned.
 int Inventory::add_item(Ref<Item> item) {
     if (Item::is_empty_or_null(item)) {
         return 0;
     }
     int stack_size = item->get_data()->get_stack_size();
-    for (int i = 0; i < (int)items.size(); i++) {
-        Ref<Item> my_item = peek_slot(i);
-        if (Item::is_empty_or_null(my_item)) {
-            set_slot(i, item);
-            break;
-        } else {
-            my_item = my_item->clone();
-        }
-        if (my_item->is_equal_type(item)) {
-            int my_count = my_item->get_count();
-            int their_count = item->get_count();
-            int their_new_count = 0;
-            int my_new_count = my_count + their_count;
-            if (my_new_count > stack_size) {
-                their_new_count = my_new_count - stack_size;
-                my_new_count = stack_size;
-            }
-            item->set_count(their_new_count);
-            my_item->set_count(my_new_count);
-            set_slot(i, my_item);
-        }
-        if (item->is_empty()) {
-            break;
-        }
+    ERR_FAIL_COND_V_MSG(stack_size <= 0, item->get_count(), "Attempt to add an item with a stack size less than 1!");
+    begin_batch();
+    int remainder = top_up_partial_slots(item->get_id(), item->get_count(), stack_size);
+    remainder = fill_free_slots(item->get_id(), remainder, stack_size);
+    commit();
+    if (remainder != item->get_count() && !item->is_read_only()) {
+        item->set_count(remainder);
     }
-    return item->get_count();
+    return remainder;
+}
+
+// Adds count of the item without needing an Item for it, topping up partial stacks before filling free slots one
+// stack at a time. Returns how many did not fit.
+int Inventory::add_item_id(StringName id, int count) {
+    if (id == StringName() || id == SNAME("empty") || count <= 0) {
+        return 0;
+    }
+    int stack_size = ItemRegistry::get_singleton()->get_stack_size(id);
+    ERR_FAIL_COND_V_MSG(stack_size <= 0, count, "Attempt to add an item with a stack size less than 1!");
+    begin_batch();
+    count = top_up_partial_slots(id, count, stack_size);
+    count = fill_free_slots(id, count, stack_size);
+    commit();
+    return count;
 }
 
 Ref<Item> Inventory::swap_item(int slot_id, Ref<Item> item) {
-    if ((int)items.size() <= slot_id) {
+    if (slot_id < 0 || size <= slot_id) {
         return item;
     }
     Ref<Item> output = peek_slot(slot_id);
@@ -245,15 +683,35 @@ Ref<Item> Inventory::swap_item(int slot_id, Ref<Item> item) {
 }
 
 int Inventory::get_item_count(StringName id) const {
-    if (cache.has(id)) {
-        return cache[id];
+    const ItemIndex *index = cache.getptr(id);
+    if (index != nullptr) {
+        return index->count;
     } else {
         return 0;
     }
 }
 
+PackedInt32Array Inventory::get_item_slots(StringName id) const {
+    PackedInt32Array output;
+    const ItemIndex *index = cache.getptr(id);
+    if (index != nullptr) {
+        output.resize(index->slots.size());
+        for (uint32_t i = 0; i < index->slots.size(); i++) {
+            output.set(i, index->slots[i]);
+        }
+    }
+    return output;
+}
+
 Inventory::Inventory() {
     size = 0;
+    compact = false;
+    track_craftable = false;
+    craftable_generation = 0;
+    craftable_item_generation = 0;
+    free_count = 0;
+    free_hint = 0;
+    batch_depth = 0;
     set_items(TypedArray<Item>());
 }
 
@@ -5,34 +5,94 @@
 #include "core/templates/hash_map.h"
 #include "core/variant/typed_array.h"
 #include "core/templates/local_vector.h"
+#include "core/templates/rb_set.h"
+#include "core/templates/hash_set.h"
 #include "item.h"
 
+class CraftingRecipe;
+
 class Inventory : public RefCounted {
     GDCLASS(Inventory, RefCounted);
 protected:
     static void _bind_methods();
     int size;
-    TightLocalVector<Ref<Item>> items;
-    HashMap<StringName, int> cache;
+    // Slot contents live in slot_ids and slot_counts. Items are only created when asked for, and in compact
+    // mode they are not kept at all, so the inventory needs no Resource per slot.
+    bool compact;
+    mutable TightLocalVector<Ref<Item>> items;
+    struct ItemIndex {
+        int count = 0;
+        // Every slot holding the item, and the subset of those that are not yet a full stack, as sorted vectors so
+        // the index allocates per id rather than per slot.
+        LocalVector<int> slots;
+        LocalVector<int> partial;
+    };
+    HashMap<StringName, ItemIndex> cache;
+    // Empty slots have an empty id and a count of 0.
+    TightLocalVector<StringName> slot_ids;
+    TightLocalVector<int> slot_counts;
+    // One bit per slot, set for empty slots. free_hint is the lowest word that can have a bit set.
+    TightLocalVector<uint64_t> free_slots;
+    int free_count;
+    uint32_t free_hint;
+    void set_slot_free(int slot_id, bool free);
+    void clear_free_slots();
+    int first_free_slot();
+    // Slots changed since begin_batch(), reported together on the outermost commit().
+    int batch_depth;
+    RBSet<int> batch_slots;
+    // Registered recipes this inventory can craft, keyed by instance id. Only recipes using an id whose count
+    // changed are checked again, unless the recipe or item registry changed since the last update.
+    bool track_craftable;
+    HashMap<uint64_t, Ref<CraftingRecipe>> craftable;
+    HashSet<StringName> craftable_dirty;
+    uint64_t craftable_generation;
+    uint64_t craftable_item_generation;
+    void update_craftable();
     void add_to_cache(StringName id, int diff);
     void invalidate_cache();
+    void index_slot(int slot_id, const StringName &id, int count);
+    void index_slot(int slot_id, Ref<Item> item);
+    void unindex_slot(int slot_id);
+    void reindex_slot(int slot_id);
+    void set_slot_count(int slot_id, int count);
+    int merge_into_slot(int slot_id, Ref<Item> item, int stack_size);
+    int top_up_partial_slots(const StringName &id, int count, int stack_size);
+    int fill_free_slots(const StringName &id, int count, int stack_size);
+    void slot_changed(int slot_id);
+    void reload_slots();
 
 public:
     int get_size() const;
     void set_size(int size);
+    bool is_compact() const;
+    void set_compact(bool compact);
     TypedArray<Item> get_items() const;
     void set_items(TypedArray<Item> items);
+    Dictionary get_items_packed() const;
+    void set_items_packed(PackedStringArray ids, PackedInt32Array counts);
     void set_slot(int slot_id, Ref<Item> item);
     bool has_item(StringName id) const;
     Ref<Item> take_slot(int slot_id);
+    Ref<Item> take_from_slot(int slot_id, int count);
+    StringName get_slot_item_id(int slot_id) const;
+    int get_slot_count(int slot_id) const;
     Ref<Item> peek_slot(int slot_id) const;
     Ref<Item> take_item(StringName id, int count);
     int add_item(Ref<Item> item);
+    int add_item_id(StringName id, int count);
     int add_slot(int slot_id, Ref<Item> item);
     Ref<Item> swap_item(int slot_id, Ref<Item> item);
     int get_item_count(StringName id) const;
+    PackedInt32Array get_item_slots(StringName id) const;
     void update_slot(int slot_id);
     ItemUseResult use_slot(int slot_id, Node *owner);
+    void begin_batch();
+    void commit();
+    Variant batch(Callable callable);
+    bool is_tracking_craftable() const;
+    void set_track_craftable(bool track_craftable);
+    TypedArray<CraftingRecipe> get_craftable_recipes();
 
     Inventory();
     ~Inventory();
@@ -11,6 +11,8 @@ void ItemData::_bind_methods() {
     ClassDB::bind_method(D_METHOD("set_texture", "texture"), &ItemData::set_texture);
     ClassDB::bind_method(D_METHOD("get_display_name"), &ItemData::get_display_name);
     ClassDB::bind_method(D_METHOD("set_display_name", "display_name"), &ItemData::set_display_name);
+    ClassDB::bind_method(D_METHOD("get_tags"), &ItemData::get_tags);
+    ClassDB::bind_method(D_METHOD("set_tags", "tags"), &ItemData::set_tags);
     ClassDB::bind_method(D_METHOD("use_item", "item", "owner"), &ItemData::use_item);
     GDVIRTUAL_BIND(_use_item, "item", "owner");
     GDVIRTUAL_BIND(_pre_unregister);
@@ -18,6 +20,7 @@ void ItemData::_bind_methods() {
     ADD_PROPERTY(PropertyInfo(Variant::INT, "stack_size"), "set_stack_size", "get_stack_size");
     ADD_PROPERTY(PropertyInfo(Variant::RECT2I, "texture"), "set_texture", "get_texture");
     ADD_PROPERTY(PropertyInfo(Variant::STRING, "display_name"), "set_display_name", "get_display_name");
+    ADD_PROPERTY(PropertyInfo(Variant::PACKED_STRING_ARRAY, "tags"), "set_tags", "get_tags");
     BIND_ENUM_CONSTANT(ITEM_USE_RESULT_CONSUME);
     BIND_ENUM_CONSTANT(ITEM_USE_RESULT_NONE);
     BIND_ENUM_CONSTANT(ITEM_USE_RESULT_FAIL);
@@ -48,6 +51,14 @@ void ItemData::set_display_name(String display_name) {
     this->display_name = display_name;
 }
 
+PackedStringArray ItemData::get_tags() {
+    return tags;
+}
+
+void ItemData::set_tags(PackedStringArray tags) {
+    this->tags = tags;
+}
+
 void ItemData::pre_unregister() {
     GDVIRTUAL_CALL(_pre_unregister);
 }
@@ -78,6 +89,9 @@ void ItemRegistry::_bind_methods() {
     ClassDB::bind_method(D_METHOD("unregister", "id"), &ItemRegistry::unregister_data);
     ClassDB::bind_method(D_METHOD("unregister_all"), &ItemRegistry::unregister_all);
     ClassDB::bind_method(D_METHOD("get_data", "id"), &ItemRegistry::get_data);
+    ClassDB::bind_method(D_METHOD("get_type_index", "id"), &ItemRegistry::get_type_index);
+    ClassDB::bind_method(D_METHOD("get_items_with_tag", "tag"), &ItemRegistry::get_items_with_tag);
+    ClassDB::bind_method(D_METHOD("has_tag", "id", "tag"), &ItemRegistry::has_tag);
     ClassDB::bind_method(D_METHOD("get_all_data"), &ItemRegistry::get_all_data);
     ClassDB::bind_method(D_METHOD("set_all_data", "data"), &ItemRegistry::set_all_data);
 
@@ -85,44 +99,134 @@ void ItemRegistry::_bind_methods() {
 }
 
 Ref<ItemData> ItemRegistry::get_data(StringName id) {
-    if (data.has(id)) {
-        return data[id];
+    const uint32_t *type = type_indices.getptr(id);
+    if (type != nullptr) {
+        return types[*type].data;
     }
-    else if (id == "empty") {
-        return memnew(ItemData);
+    else if (id == SNAME("empty")) {
+        return placeholder;
     }
     else {
-        ERR_FAIL_V_MSG(memnew(ItemData), vformat("Item ID '%s' not found.", id));
+        ERR_FAIL_V_MSG(placeholder, vformat("Item ID '%s' not found.", id));
+    }
+}
+
+// Expects a type index that is current for id, see resolve_type_index.
+Ref<ItemData> ItemRegistry::get_data_by_type(uint32_t type, const StringName &id) {
+    if (type != TYPE_EMPTY && type < types.size()) {
+        return types[type].data;
+    }
+    return get_data(id);
+}
+
+uint32_t ItemRegistry::get_type_index(StringName id) const {
+    if (id == SNAME("empty")) {
+        return TYPE_EMPTY;
+    }
+    const uint32_t *type = type_indices.getptr(id);
+    return type != nullptr ? *type : TYPE_UNKNOWN;
+}
+
+uint32_t ItemRegistry::resolve_type_index(uint32_t type, const StringName &id) const {
+    if (type < types.size() && types[type].id == id && (type == TYPE_EMPTY || types[type].data.is_valid())) {
+        return type;
+    }
+    return get_type_index(id);
+}
+
+// Like get_data(id)->get_stack_size(), without reporting unknown ids.
+int ItemRegistry::get_stack_size(const StringName &id) {
+    const uint32_t *type = type_indices.getptr(id);
+    if (type != nullptr) {
+        return types[*type].data->get_stack_size();
+    }
+    return placeholder->get_stack_size();
+}
+
+// Registered ids carrying the tag, or nullptr if there are none.
+const LocalVector<StringName> *ItemRegistry::get_tag_items(const StringName &tag) const {
+    return tag_items.getptr(tag);
+}
+
+// Tags of a registered id, or nullptr if it is not registered.
+const LocalVector<StringName> *ItemRegistry::get_item_tags(const StringName &id) const {
+    const uint32_t *type = type_indices.getptr(id);
+    return type != nullptr ? &types[*type].tags : nullptr;
+}
+
+PackedStringArray ItemRegistry::get_items_with_tag(StringName tag) const {
+    PackedStringArray output;
+    const LocalVector<StringName> *ids = tag_items.getptr(tag);
+    if (ids != nullptr) {
+        for (uint32_t i = 0; i < ids->size(); i++) {
+            output.push_back((*ids)[i]);
+        }
     }
+    return output;
+}
+
+bool ItemRegistry::has_tag(StringName id, StringName tag) const {
+    const LocalVector<StringName> *tags = get_item_tags(id);
+    return tags != nullptr && tags->find(tag) >= 0;
 }
 
 void ItemRegistry::register_data(StringName id, Ref<ItemData> new_data) {
     ERR_FAIL_NULL_MSG(new_data, vformat("Attempt to register null data to '%s'!", id));
-    if (data.has(id)) {
+    ERR_FAIL_COND_MSG(id == SNAME("empty"), "The item ID 'empty' is reserved for empty items!");
+    if (type_indices.has(id)) {
         unregister_data(id);
     }
-    data[id] = Ref<ItemData>(new_data);
-    registered.push_back(id);
+    uint32_t type;
+    if (free_types.is_empty()) {
+        type = types.size();
+        types.push_back(ItemType());
+    } else {
+        type = free_types[free_types.size() - 1];
+        free_types.remove_at(free_types.size() - 1);
+    }
+    types[type].id = id;
+    types[type].data = new_data;
+    for (int i = 0; i < new_data->tags.size(); i++) {
+        StringName tag = new_data->tags[i];
+        if (tag != StringName() && types[type].tags.find(tag) < 0) {
+            types[type].tags.push_back(tag);
+            tag_items[tag].push_back(id);
+        }
+    }
+    type_indices[id] = type;
+    generation++;
 }
 
 void ItemRegistry::unregister_data(StringName id) {
-    if (data.has(id)) {
-        data[id]->pre_unregister();
-        registered.erase(id);
-        data.erase(id);
+    const uint32_t *type_ptr = type_indices.getptr(id);
+    if (type_ptr != nullptr) {
+        uint32_t type = *type_ptr;
+        types[type].data->pre_unregister();
+        for (uint32_t i = 0; i < types[type].tags.size(); i++) {
+            LocalVector<StringName> *ids = tag_items.getptr(types[type].tags[i]);
+            if (ids != nullptr) {
+                ids->erase(id);
+                if (ids->is_empty()) {
+                    tag_items.erase(types[type].tags[i]);
+                }
+            }
+        }
+        type_indices.erase(id);
+        types[type] = ItemType();
+        free_types.push_back(type);
+        generation++;
     }
 }
 void ItemRegistry::unregister_all() {
-    while (!registered.is_empty()) {
-        unregister_data(registered[0]);
+    while (!type_indices.is_empty()) {
+        unregister_data(type_indices.begin()->key);
     }
 }
 
 Dictionary ItemRegistry::get_all_data() {
     Dictionary output;
-    for (int i = 0; i < (int)registered.size(); i++) {
-        StringName name = registered[i];
-        output[name] = data[name];
+    for (const KeyValue<StringName, uint32_t> &E : type_indices) {
+        output[E.key] = types[E.value].data;
     }
     return output;
 }
@@ -153,8 +257,12 @@ ItemUseResult ItemRegistry::use_item(Ref<Item> item, Node* owner) {
 }
 
 ItemRegistry::ItemRegistry() {
-    data = HashMap<StringName, Ref<ItemData>>();
-    registered = LocalVector<StringName>();
+    // Type index 0 always stands for empty items.
+    types.push_back(ItemType());
+    types[TYPE_EMPTY].id = SNAME("empty");
+    // Items start at generation 0, so they resolve their data on first use.
+    generation = 1;
+    placeholder = Ref<ItemData>(memnew(ItemData));
     singleton = this;
 }
 
@@ -162,16 +270,23 @@ ItemRegistry::~ItemRegistry() {
     if (singleton == this) {
         singleton = nullptr;
     }
-    registered.clear();
-    data.clear();
+    type_indices.clear();
+    free_types.clear();
+    types.clear();
+    placeholder = Ref<ItemData>(nullptr);
 }
 
 void Item::_bind_methods() {
     ClassDB::bind_static_method("Item", D_METHOD("is_empty_or_null", "iten"), &Item::is_empty_or_null);
+    ClassDB::bind_static_method("Item", D_METHOD("get_empty"), &Item::get_empty);
+    ClassDB::bind_method(D_METHOD("is_read_only"), &Item::is_read_only);
+    ClassDB::bind_static_method("Item", D_METHOD("get_allocation_count"), &Item::get_allocation_count);
+    ClassDB::bind_static_method("Item", D_METHOD("get_live_count"), &Item::get_live_count);
     ClassDB::bind_method(D_METHOD("get_count"), &Item::get_count);
     ClassDB::bind_method(D_METHOD("set_count", "count"), &Item::set_count);
     ClassDB::bind_method(D_METHOD("get_id"), &Item::get_id);
     ClassDB::bind_method(D_METHOD("set_id", "id"), &Item::set_id);
+    ClassDB::bind_method(D_METHOD("get_type_index"), &Item::get_type_index);
     ClassDB::bind_method(D_METHOD("make_empty"), &Item::make_empty);
     ClassDB::bind_method(D_METHOD("get_data"), &Item::get_data);
     ClassDB::bind_method(D_METHOD("is_empty"), &Item::is_empty);
@@ -189,6 +304,7 @@ int Item::get_count() const {
 }
 
 void Item::set_count(int count) {
+    ERR_FAIL_COND_MSG(read_only, "Attempt to change a read-only item! Use clone() to get a copy that can be changed.");
     if (count == 0) {
         make_empty();
         return;
@@ -207,11 +323,36 @@ StringName Item::get_id() const {
 }
 
 void Item::set_id(StringName id) {
+    ERR_FAIL_COND_MSG(read_only, "Attempt to change a read-only item! Use clone() to get a copy that can be changed.");
     this->id = id;
+    data_generation = 0;
+    ItemRegistry *registry = ItemRegistry::get_singleton();
+    if (registry != nullptr) {
+        type = registry->get_type_index(id);
+    } else {
+        type = id == SNAME("empty") ? ItemRegistry::TYPE_EMPTY : ItemRegistry::TYPE_UNKNOWN;
+    }
+}
+
+void Item::refresh_data() const {
+    ItemRegistry *registry = ItemRegistry::get_singleton();
+    if (data_generation != registry->get_generation()) {
+        type = registry->resolve_type_index(type, id);
+        cached_data = registry->get_data_by_type(type, id);
+        data_generation = registry->get_generation();
+    }
+}
+
+uint32_t Item::get_type_index() const {
+    refresh_data();
+    return type;
 }
 
 void Item::make_empty() {
-    this->id = "empty";
+    ERR_FAIL_COND_MSG(read_only, "Attempt to change a read-only item! Use clone() to get a copy that can be changed.");
+    this->id = SNAME("empty");
+    this->type = ItemRegistry::TYPE_EMPTY;
+    this->data_generation = 0;
     this->count = 0;
 }
 
@@ -227,17 +368,51 @@ ItemUseResult Item::use(Node *owner) {
 }
 
 Ref<ItemData> Item::get_data() const {
-    return ItemRegistry::get_singleton()->get_data(id);
+    refresh_data();
+    return cached_data;
 }
 
 bool Item::is_empty() const {
-    return id == "empty" || count <= 0;
+    return type == ItemRegistry::TYPE_EMPTY || count <= 0;
 }
 
 bool Item::is_empty_or_null(const Ref<Item> item) {
     return item.is_null() || item->is_empty();
 }
 
+Ref<Item> Item::empty_item = Ref<Item>(nullptr);
+
+// Shared empty item returned wherever there is nothing to return, so reading empty slots does not allocate.
+Ref<Item> Item::get_empty() {
+    return empty_item;
+}
+
+bool Item::is_read_only() const {
+    return read_only;
+}
+
+SafeNumeric<uint64_t> Item::allocation_count;
+SafeNumeric<uint64_t> Item::live_count;
+
+// Number of items created since startup.
+uint64_t Item::get_allocation_count() {
+    return allocation_count.get();
+}
+
+// Number of items currently alive.
+uint64_t Item::get_live_count() {
+    return live_count.get();
+}
+
+void Item::register_hook() {
+    empty_item = Ref<Item>(memnew(Item));
+    empty_item->read_only = true;
+}
+
+void Item::unregister_hook() {
+    empty_item = Ref<Item>(nullptr);
+}
+
 bool Item::is_full() const {
     return !is_empty() && count >= get_data()->get_stack_size();
 }
@@ -256,14 +431,17 @@ bool Item::is_equal_type(const Ref<Item> other) const {
 }
 
 Item::Item(StringName id, int count) {
-    this->id = id;
+    allocation_count.increment();
+    live_count.increment();
+    read_only = false;
+    set_id(id);
     this->count = count;
 }
 
-Item::Item() : Item::Item("empty", 0) {
+Item::Item() : Item::Item(SNAME("empty"), 0) {
     // Nothing more needs to be done here.
 }
 
 Item::~Item() {
-
+    live_count.decrement();
 }
@@ -4,6 +4,7 @@
 #include "core/object/ref_counted.h"
 #include "core/templates/hash_map.h"
 #include "core/templates/local_vector.h"
+#include "core/templates/safe_refcount.h"
 #include "core/math/rect2i.h"
 #include "core/string/ustring.h"
 #include "core/string/string_name.h"
@@ -32,6 +33,8 @@ protected:
 	Ref<Texture2D> texture;
 	String display_name;
 	int stack_size;
+	// Read by the registry when the data is registered, so changes only apply after registering it again.
+	PackedStringArray tags;
 	void pre_unregister();
 	ItemUseResult use_item(Ref<Item> item, Node* owner);
 public:
@@ -41,6 +44,8 @@ public:
 	void set_texture(Ref<Texture2D> image);
 	String get_display_name();
 	void set_display_name(String display_name);
+	PackedStringArray get_tags();
+	void set_tags(PackedStringArray tags);
 	GDVIRTUAL2RC(ItemUseResult, _use_item, Ref<Item>, Node *);
 	GDVIRTUAL0C(_pre_unregister);
 	ItemData();
@@ -52,12 +57,37 @@ class ItemRegistry : public Node {
 protected:
 	static void _bind_methods();
 
-	HashMap<StringName, Ref<ItemData>> data;
-	LocalVector<StringName> registered;
+	struct ItemType {
+		StringName id;
+		Ref<ItemData> data;
+		LocalVector<StringName> tags;
+	};
+	// Dense type indices. Index 0 is reserved for empty items and unregistered indices are reused.
+	LocalVector<ItemType> types;
+	LocalVector<uint32_t> free_types;
+	HashMap<StringName, uint32_t> type_indices;
+	// Registered ids carrying each tag.
+	HashMap<StringName, LocalVector<StringName>> tag_items;
+	// Changes on every register or unregister, so cached lookups can tell when they are stale.
+	uint64_t generation;
+	// Shared data returned for empty and unknown ids.
+	Ref<ItemData> placeholder;
 	static ItemRegistry* singleton;
 public:
+	static constexpr uint32_t TYPE_EMPTY = 0;
+	static constexpr uint32_t TYPE_UNKNOWN = UINT32_MAX;
+
 	_ALWAYS_INLINE_ static ItemRegistry* get_singleton() { return singleton; }
+	_ALWAYS_INLINE_ uint64_t get_generation() const { return generation; }
 	Ref<ItemData> get_data(StringName id);
+	Ref<ItemData> get_data_by_type(uint32_t type, const StringName &id);
+	uint32_t get_type_index(StringName id) const;
+	uint32_t resolve_type_index(uint32_t type, const StringName &id) const;
+	int get_stack_size(const StringName &id);
+	const LocalVector<StringName> *get_tag_items(const StringName &tag) const;
+	const LocalVector<StringName> *get_item_tags(const StringName &id) const;
+	PackedStringArray get_items_with_tag(StringName tag) const;
+	bool has_tag(StringName id, StringName tag) const;
 	Dictionary get_all_data();
 	void set_all_data(Dictionary data);
 	ItemUseResult use_item(Ref<Item> item, Node* owner);
@@ -75,20 +105,38 @@ protected:
 	static void _bind_methods();
 	int count;
 	StringName id;
+	// Registry type index and data of id, resolved again whenever the registry generation changes.
+	mutable uint32_t type;
+	mutable Ref<ItemData> cached_data;
+	mutable uint64_t data_generation;
+	// Read-only items refuse changes, see get_empty().
+	bool read_only;
+	static Ref<Item> empty_item;
+	static SafeNumeric<uint64_t> allocation_count;
+	static SafeNumeric<uint64_t> live_count;
+	void refresh_data() const;
 public:
 	int get_count() const;
 	void set_count(int count);
 	StringName get_id() const;
 	void set_id(StringName id);
+	uint32_t get_type_index() const;
 
 	Ref<ItemData> get_data() const;
 	bool is_empty() const;
 	static bool is_empty_or_null(const Ref<Item> item);
+	static Ref<Item> get_empty();
+	bool is_read_only() const;
+	static uint64_t get_allocation_count();
+	static uint64_t get_live_count();
 	void make_empty();
 	bool is_full() const;
 	bool is_equal_type(const Ref<Item> other) const;
 	Ref<Item> clone() const;
 	ItemUseResult use(Node *owner);
+
+	static void register_hook();
+	static void unregister_hook();
 	
 	Item();
 	Item(StringName id, int count);
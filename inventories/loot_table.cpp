@@ -1,10 +1,101 @@
 #include "loot_table.h"
-#include "core/math/random_number_generator.h"
+#include "core/math/math_funcs.h"
+#include "core/object/worker_thread_pool.h"
+#include "inventory.h"
+
+// The SplitMix64 finalizer, which spreads every bit of value over the whole result.
+uint64_t LootRoll::mix(uint64_t value) {
+	value = (value ^ (value >> 30)) * 0xbf58476d1ce4e5b9ULL;
+	value = (value ^ (value >> 27)) * 0x94d049bb133111ebULL;
+	return value ^ (value >> 31);
+}
+
+uint64_t LootRoll::next() {
+	counter++;
+	return mix(key + counter * 0x9e3779b97f4a7c15ULL);
+}
+
+// Uniform in [0, bound), without the bias of taking a random number modulo bound.
+uint64_t LootRoll::below(uint64_t bound) {
+	uint64_t limit = UINT64_MAX - UINT64_MAX % bound;
+	uint64_t value;
+	do {
+		value = next();
+	} while (value >= limit);
+	return value % bound;
+}
+
+// Uniform in [from, to], both included.
+int LootRoll::range(int from, int to) {
+	if (to <= from) {
+		return from;
+	}
+	return from + (int)below((uint64_t)((int64_t)to - from) + 1);
+}
+
+LootRoll LootRoll::unseeded() {
+	return LootRoll(((uint64_t)Math::rand() << 32) | Math::rand(), 0);
+}
+
+LootRoll::LootRoll(uint64_t seed, uint64_t roll_index) {
+	key = mix(mix(seed) ^ roll_index);
+}
+
+// Builds a Vose alias table over count weights and returns their total. Column i is kept when a draw below the total
+// is under r_thresholds[i], and gives way to r_aliases[i] otherwise. Everything is integer, so each weight comes up
+// with exactly its share of the total.
+static uint64_t build_alias_table(const uint64_t *weights, uint32_t count, uint64_t *r_thresholds, uint32_t *r_aliases) {
+	uint64_t total = 0;
+	// Weights scaled by the count, so a column holding the average weight is exactly full.
+	LocalVector<uint64_t> scaled;
+	scaled.resize(count);
+	for (uint32_t i = 0; i < count; i++) {
+		scaled[i] = weights[i] * count;
+		total += weights[i];
+	}
+	LocalVector<uint32_t> small;
+	LocalVector<uint32_t> large;
+	for (uint32_t i = 0; i < count; i++) {
+		if (scaled[i] < total) {
+			small.push_back(i);
+		} else {
+			large.push_back(i);
+		}
+	}
+	while (!small.is_empty() && !large.is_empty()) {
+		uint32_t less = small[small.size() - 1];
+		uint32_t more = large[large.size() - 1];
+		small.resize(small.size() - 1);
+		r_thresholds[less] = scaled[less];
+		r_aliases[less] = more;
+		scaled[more] -= total - scaled[less];
+		if (scaled[more] < total) {
+			large.resize(large.size() - 1);
+			small.push_back(more);
+		}
+	}
+	// With exact arithmetic, whatever is left fills its column completely.
+	for (uint32_t i = 0; i < small.size(); i++) {
+		r_thresholds[small[i]] = total;
+		r_aliases[small[i]] = small[i];
+	}
+	for (uint32_t i = 0; i < large.size(); i++) {
+		r_thresholds[large[i]] = total;
+		r_aliases[large[i]] = large[i];
+	}
+	return total;
+}
 
 void LootTable::_bind_methods() {
 	ClassDB::bind_method(D_METHOD("get_root"), &LootTable::get_root);
 	ClassDB::bind_method(D_METHOD("set_root", "root"), &LootTable::set_root);
 	ClassDB::bind_method(D_METHOD("get_output"), &LootTable::get_output);
+	ClassDB::bind_method(D_METHOD("get_output_seeded", "seed", "roll_index"), &LootTable::get_output_seeded);
+	ClassDB::bind_method(D_METHOD("get_outputs"), &LootTable::get_outputs);
+	ClassDB::bind_method(D_METHOD("get_outputs_seeded", "seed", "roll_index"), &LootTable::get_outputs_seeded);
+	ClassDB::bind_method(D_METHOD("roll_batch", "rolls"), &LootTable::roll_batch);
+	ClassDB::bind_method(D_METHOD("roll_into", "inventory", "rolls"), &LootTable::roll_into);
+	ClassDB::bind_method(D_METHOD("compute_distribution", "monte_carlo_rolls"), &LootTable::compute_distribution, DEFVAL(1000000));
 
 	ADD_PROPERTY(PropertyInfo(Variant::OBJECT, "root", PROPERTY_HINT_RESOURCE_TYPE, "LootTableEntry"), "set_root", "get_root");
 }
@@ -14,17 +105,546 @@ Ref<LootTableEntry> LootTable::get_root() {
 }
 
 void LootTable::set_root(Ref<LootTableEntry> root) {
+	if (this->root.is_valid() && this->root->is_connected("changed", on_root_changed_callable)) {
+		this->root->disconnect("changed", on_root_changed_callable);
+	}
 	this->root = root;
+	if (root.is_valid()) {
+		root->connect("changed", on_root_changed_callable);
+	}
+	on_root_changed();
+}
+
+void LootTable::on_root_changed() {
+	{
+		MutexLock lock(program_mutex);
+		program_dirty = true;
+	}
+	emit_changed();
+}
+
+uint32_t LootTable::Program::add_node(ProgramNodeType type) {
+	ProgramNode node;
+	node.type = type;
+	nodes.push_back(node);
+	return nodes.size() - 1;
+}
+
+void LootTable::compile() {
+	Ref<Program> compiled_program;
+	compiled_program.instantiate();
+	if (root.is_valid()) {
+		HashMap<const LootTableEntry *, uint32_t> compiled;
+		HashSet<const LootTableEntry *> visiting;
+		compile_entry(**compiled_program, root, compiled, visiting);
+	}
+	// Entries are rolled through their own code, which builds its tables on the first roll, so that is done here
+	// before any rolls can run on other threads.
+	HashSet<LootTableEntry *> prepared;
+	for (uint32_t i = 0; i < compiled_program->program_entries.size(); i++) {
+		compiled_program->program_entries[i]->prepare_rolls(prepared);
+	}
+	program = compiled_program;
+	program_dirty = false;
+	program_registry_generation = ItemRegistry::get_singleton()->get_generation();
+}
+
+// Compiles the entry into a node and returns its index. The node is added before its children, so the root is node 0.
+uint32_t LootTable::compile_entry(Program &r_program, const Ref<LootTableEntry> &entry, HashMap<const LootTableEntry *, uint32_t> &compiled, HashSet<const LootTableEntry *> &visiting) {
+	const uint32_t *existing = compiled.getptr(entry.ptr());
+	if (existing != nullptr) {
+		return *existing;
+	}
+	ERR_FAIL_COND_V_MSG(visiting.has(entry.ptr()), r_program.add_node(NODE_EMPTY), "This loot table contains an entry inside itself!");
+	visiting.insert(entry.ptr());
+	uint32_t index = r_program.add_node(NODE_EMPTY);
+	compiled[entry.ptr()] = index;
+	// Scripts can change what any entry outputs, so scripted entries are always called.
+	bool scripted = entry->get_script_instance() != nullptr;
+	const LootTableEntryConstant *constant = Object::cast_to<LootTableEntryConstant>(entry.ptr());
+	const LootTableEntryRandomize *randomize = Object::cast_to<LootTableEntryRandomize>(entry.ptr());
+	const LootTableEntryArray *array = Object::cast_to<LootTableEntryArray>(entry.ptr());
+	// Distinct picks output several items, so they are rolled as entries.
+	if (Object::cast_to<LootTableEntryDistinct>(entry.ptr()) != nullptr) {
+		array = nullptr;
+	}
+	if (!scripted && constant != nullptr) {
+		if (!Item::is_empty_or_null(constant->output)) {
+			ProgramItem item;
+			item.id = constant->output->get_id();
+			item.count = constant->output->get_count();
+			item.stack_size = ItemRegistry::get_singleton()->get_stack_size(item.id);
+			item.type = ItemRegistry::get_singleton()->get_type_index(item.id);
+			r_program.nodes[index].type = NODE_ITEM;
+			r_program.nodes[index].first = r_program.program_items.size();
+			r_program.program_items.push_back(item);
+		}
+	} else if (!scripted && randomize != nullptr) {
+		if (randomize->entry.is_null()) {
+			ERR_PRINT("This loot table entry randomizer doesn't have a loot table entry to randomize!");
+		} else {
+			uint32_t child = compile_entry(r_program, randomize->entry, compiled, visiting);
+			r_program.nodes[index].type = NODE_RANDOMIZE;
+			r_program.nodes[index].first = child;
+			r_program.nodes[index].min = randomize->min;
+			r_program.nodes[index].max = randomize->max;
+		}
+	} else if (!scripted && array != nullptr) {
+		LocalVector<uint32_t> children;
+		LocalVector<uint64_t> weights;
+		for (int i = 0; i < array->entries.size(); i++) {
+			Ref<LootTableEntry> child = array->entries[i];
+			if (child.is_null() || child->get_weight() <= 0) {
+				continue;
+			}
+			children.push_back(compile_entry(r_program, child, compiled, visiting));
+			weights.push_back(child->get_weight());
+		}
+		if (children.is_empty()) {
+			ERR_PRINT("This array loot table entry doesn't have any entries with a positive weight!");
+		} else {
+			LocalVector<uint64_t> thresholds;
+			LocalVector<uint32_t> aliases;
+			thresholds.resize(children.size());
+			aliases.resize(children.size());
+			// Children add their own columns, so this node's columns go after all of them.
+			r_program.nodes[index].type = NODE_PICK;
+			r_program.nodes[index].first = r_program.columns.size();
+			r_program.nodes[index].count = children.size();
+			r_program.nodes[index].total_weight = build_alias_table(weights.ptr(), children.size(), thresholds.ptr(), aliases.ptr());
+			if (r_program.nodes[index].total_weight <= UINT64_MAX / children.size()) {
+				r_program.nodes[index].range = r_program.nodes[index].total_weight * children.size();
+			}
+			for (uint32_t i = 0; i < children.size(); i++) {
+				ProgramColumn column;
+				column.threshold = thresholds[i];
+				column.node = children[i];
+				column.alias_node = children[aliases[i]];
+				r_program.columns.push_back(column);
+			}
+		}
+	} else {
+		r_program.nodes[index].type = NODE_ENTRY;
+		r_program.nodes[index].first = r_program.program_entries.size();
+		r_program.program_entries.push_back(entry);
+	}
+	visiting.erase(entry.ptr());
+	return index;
+}
+
+// Stack sizes and type indices come from the registry, so the program is compiled again when it changes. The
+// returned program stays valid for as long as it is held, even if another thread compiles a new one meanwhile.
+Ref<LootTable::Program> LootTable::get_program() {
+	MutexLock lock(program_mutex);
+	if (program.is_null() || program_dirty || program_registry_generation != ItemRegistry::get_singleton()->get_generation()) {
+		compile();
+	}
+	return program;
+}
+
+// Only the outermost randomizer matters, since each one overrides the count set inside it.
+void LootTable::Program::roll(LootRoll &random, RollResult &r_result) const {
+	r_result.item = nullptr;
+	r_result.count = 0;
+	if (nodes.is_empty()) {
+		return;
+	}
+	const ProgramNode *randomize = nullptr;
+	uint32_t index = 0;
+	while (r_result.item == nullptr) {
+		const ProgramNode &node = nodes[index];
+		switch (node.type) {
+			case NODE_EMPTY:
+				return;
+			case NODE_ITEM:
+				r_result.item = &program_items[node.first];
+				r_result.count = r_result.item->count;
+				break;
+			case NODE_PICK: {
+				uint64_t draw;
+				const ProgramColumn *column;
+				if (node.range != 0) {
+					uint64_t value = random.below(node.range);
+					column = &columns[node.first + value / node.total_weight];
+					draw = value % node.total_weight;
+				} else {
+					column = &columns[node.first + random.below(node.count)];
+					draw = random.below(node.total_weight);
+				}
+				index = draw < column->threshold ? column->node : column->alias_node;
+			} break;
+			case NODE_RANDOMIZE:
+				if (randomize == nullptr) {
+					randomize = &node;
+				}
+				index = node.first;
+				break;
+			case NODE_ENTRY: {
+				r_result.entry_items.clear();
+				program_entries[node.first]->roll_outputs(random, r_result.entry_items);
+				if (r_result.entry_items.is_empty()) {
+					return;
+				}
+				r_result.entry_outputs.resize(r_result.entry_items.size());
+				for (uint32_t i = 0; i < r_result.entry_items.size(); i++) {
+					const Ref<Item> &output = r_result.entry_items[i];
+					ProgramItem &entry_output = r_result.entry_outputs[i];
+					entry_output.id = output->get_id();
+					entry_output.count = output->get_count();
+					entry_output.stack_size = ItemRegistry::get_singleton()->get_stack_size(entry_output.id);
+					entry_output.type = output->get_type_index();
+				}
+				r_result.entry_items.clear();
+				r_result.item = r_result.entry_outputs.ptr();
+				r_result.count = r_result.item->count;
+			} break;
+		}
+	}
+	if (randomize != nullptr) {
+		int high = MIN(r_result.item->stack_size, randomize->max);
+		int low = MIN(MAX(1, randomize->min), high);
+		r_result.count = random.range(low, high);
+		if (r_result.is_entry_output()) {
+			r_result.entry_outputs[0].count = r_result.count;
+			for (uint32_t i = 1; i < r_result.entry_outputs.size(); i++) {
+				ProgramItem &entry_output = r_result.entry_outputs[i];
+				high = MIN(entry_output.stack_size, randomize->max);
+				low = MIN(MAX(1, randomize->min), high);
+				entry_output.count = random.range(low, high);
+			}
+		}
+	}
 }
 
 Ref<Item> LootTable::get_output() {
-	ERR_FAIL_NULL_V_MSG(root, memnew(Item), "This loot table does not have a root!");
+	return get_output_seeded(seed, roll_count.increment() - 1);
+}
 
-	return root->get_output();
+// Rolls the table with random numbers that only depend on seed and roll_index, so the same table gives the same
+// output for them on any machine and thread. Scripted entries are only reproducible if their scripts are.
+Ref<Item> LootTable::get_output_seeded(int64_t seed, int64_t roll_index) {
+	ERR_FAIL_NULL_V_MSG(root, Item::get_empty(), "This loot table does not have a root!");
+	Ref<Program> snapshot = get_program();
+	LootRoll random(seed, roll_index);
+	RollResult result;
+	snapshot->roll(random, result);
+	if (result.item == nullptr || result.count <= 0) {
+		return Item::get_empty();
+	}
+	return memnew(Item(result.item->id, result.count));
+}
+
+TypedArray<Item> LootTable::get_outputs() {
+	return get_outputs_seeded(seed, roll_count.increment() - 1);
+}
+
+// Like get_output_seeded, but returns every item the roll outputs, for tables with entries that output several.
+TypedArray<Item> LootTable::get_outputs_seeded(int64_t seed, int64_t roll_index) {
+	TypedArray<Item> outputs;
+	ERR_FAIL_NULL_V_MSG(root, outputs, "This loot table does not have a root!");
+	Ref<Program> snapshot = get_program();
+	LootRoll random(seed, roll_index);
+	RollResult result;
+	snapshot->roll(random, result);
+	if (result.item == nullptr || result.count <= 0) {
+		return outputs;
+	}
+	if (!result.is_entry_output()) {
+		outputs.push_back(memnew(Item(result.item->id, result.count)));
+		return outputs;
+	}
+	for (uint32_t i = 0; i < result.entry_outputs.size(); i++) {
+		if (result.entry_outputs[i].count > 0) {
+			outputs.push_back(memnew(Item(result.entry_outputs[i].id, result.entry_outputs[i].count)));
+		}
+	}
+	return outputs;
+}
+
+// Rolls the table with the next rolls roll indices and adds up the total of each id, without creating any Items.
+void LootTable::roll_totals(int rolls, HashMap<StringName, int64_t> &r_totals) {
+	Ref<Program> snapshot = get_program();
+	// Totals are kept per compiled item, and only merged by id at the end.
+	LocalVector<int64_t> totals;
+	totals.resize(snapshot->program_items.size());
+	for (uint32_t i = 0; i < totals.size(); i++) {
+		totals[i] = 0;
+	}
+	HashMap<StringName, int64_t> entry_totals;
+	RollResult result;
+	uint64_t first_roll = roll_count.add(rolls) - rolls;
+	for (int i = 0; i < rolls; i++) {
+		LootRoll random(seed, first_roll + i);
+		snapshot->roll(random, result);
+		if (result.item == nullptr || result.count <= 0) {
+			continue;
+		}
+		if (result.is_entry_output()) {
+			for (uint32_t j = 0; j < result.entry_outputs.size(); j++) {
+				const StringName &id = result.entry_outputs[j].id;
+				entry_totals[id] = (entry_totals.has(id) ? entry_totals[id] : 0) + result.entry_outputs[j].count;
+			}
+		} else {
+			totals[result.item - snapshot->program_items.ptr()] += result.count;
+		}
+	}
+	for (uint32_t i = 0; i < totals.size(); i++) {
+		if (totals[i] > 0) {
+			r_totals[snapshot->program_items[i].id] = (r_totals.has(snapshot->program_items[i].id) ? r_totals[snapshot->program_items[i].id] : 0) + totals[i];
+		}
+	}
+	for (const KeyValue<StringName, int64_t> &E : entry_totals) {
+		r_totals[E.key] = (r_totals.has(E.key) ? r_totals[E.key] : 0) + E.value;
+	}
+}
+
+Dictionary LootTable::pack_totals(const HashMap<StringName, int64_t> &totals) {
+	Dictionary output;
+	PackedStringArray ids;
+	PackedInt64Array counts;
+	for (const KeyValue<StringName, int64_t> &E : totals) {
+		ids.push_back(E.key);
+		counts.push_back(E.value);
+	}
+	output["ids"] = ids;
+	output["counts"] = counts;
+	return output;
+}
+
+// Rolls the table many times and adds up the outputs, without creating any Items. Returns a dictionary with "ids", a
+// PackedStringArray, and "counts", a PackedInt64Array with the total count of each id.
+Dictionary LootTable::roll_batch(int rolls) {
+	ERR_FAIL_NULL_V_MSG(root, Dictionary(), "This loot table does not have a root!");
+	ERR_FAIL_COND_V_MSG(rolls < 0, Dictionary(), "Attempt to roll a loot table a negative number of times!");
+	HashMap<StringName, int64_t> totals;
+	roll_totals(rolls, totals);
+	return pack_totals(totals);
+}
+
+// Rolls the table many times and adds the outputs straight to the inventory in one batch, so it only reports its
+// changes once. Returns what did not fit in the same form as roll_batch.
+Dictionary LootTable::roll_into(Ref<Inventory> inventory, int rolls) {
+	ERR_FAIL_NULL_V_MSG(root, Dictionary(), "This loot table does not have a root!");
+	ERR_FAIL_COND_V_MSG(inventory.is_null(), Dictionary(), "Attempt to roll a loot table into a null inventory!");
+	ERR_FAIL_COND_V_MSG(rolls < 0, Dictionary(), "Attempt to roll a loot table a negative number of times!");
+	HashMap<StringName, int64_t> totals;
+	roll_totals(rolls, totals);
+	HashMap<StringName, int64_t> leftovers;
+	inventory->begin_batch();
+	for (const KeyValue<StringName, int64_t> &E : totals) {
+		int64_t remaining = E.value;
+		while (remaining > 0) {
+			int part = MIN(remaining, (int64_t)INT32_MAX);
+			int left = inventory->add_item_id(E.key, part);
+			remaining -= part - left;
+			if (left > 0) {
+				break;
+			}
+		}
+		if (remaining > 0) {
+			leftovers[E.key] = remaining;
+		}
+	}
+	inventory->commit();
+	return pack_totals(leftovers);
+}
+
+// Works out the chance of each compiled item coming out of the node and its expected count, counting rolls where
+// something else comes out as 0. Returns false if the node can reach an entry node, which can not be analyzed.
+bool LootTable::Program::analyze_node(uint32_t index, LocalVector<bool> &analyzed, LocalVector<LocalVector<double>> &probabilities, LocalVector<LocalVector<double>> &expected) const {
+	if (analyzed[index]) {
+		return true;
+	}
+	const ProgramNode &node = nodes[index];
+	LocalVector<double> &probability = probabilities[index];
+	LocalVector<double> &expected_count = expected[index];
+	probability.resize(program_items.size());
+	expected_count.resize(program_items.size());
+	for (uint32_t i = 0; i < program_items.size(); i++) {
+		probability[i] = 0.0;
+		expected_count[i] = 0.0;
+	}
+	switch (node.type) {
+		case NODE_EMPTY:
+			break;
+		case NODE_ITEM:
+			probability[node.first] = 1.0;
+			expected_count[node.first] = program_items[node.first].count;
+			break;
+		case NODE_PICK:
+			for (uint32_t i = 0; i < node.count; i++) {
+				const ProgramColumn &column = columns[node.first + i];
+				double keep = (double)column.threshold / (double)node.total_weight;
+				uint32_t children[2] = { column.node, column.alias_node };
+				double weights[2] = { keep / node.count, (1.0 - keep) / node.count };
+				for (int j = 0; j < 2; j++) {
+					if (weights[j] <= 0.0) {
+						continue;
+					}
+					if (!analyze_node(children[j], analyzed, probabilities, expected)) {
+						return false;
+					}
+					for (uint32_t k = 0; k < program_items.size(); k++) {
+						probability[k] += weights[j] * probabilities[children[j]][k];
+						expected_count[k] += weights[j] * expected[children[j]][k];
+					}
+				}
+			}
+			break;
+		case NODE_RANDOMIZE:
+			if (!analyze_node(node.first, analyzed, probabilities, expected)) {
+				return false;
+			}
+			// The count is uniform in the same range roll() uses, whatever the entry inside set it to.
+			for (uint32_t i = 0; i < program_items.size(); i++) {
+				probability[i] = probabilities[node.first][i];
+				int high = MIN(program_items[i].stack_size, node.max);
+				int low = MIN(MAX(1, node.min), high);
+				expected_count[i] = probability[i] * (low + high) / 2.0;
+			}
+			break;
+		case NODE_ENTRY:
+			return false;
+	}
+	analyzed[index] = true;
+	return true;
+}
+
+void LootTable::sample_distribution(void *p_batch, uint32_t p_index) {
+	DistributionBatch *batch = (DistributionBatch *)p_batch;
+	DistributionSample &sample = batch->samples[p_index];
+	const Program *snapshot = batch->program;
+	sample.hits.resize(snapshot->program_items.size());
+	sample.counts.resize(snapshot->program_items.size());
+	for (uint32_t i = 0; i < snapshot->program_items.size(); i++) {
+		sample.hits[i] = 0;
+		sample.counts[i] = 0;
+	}
+	int first = p_index * DISTRIBUTION_ROLLS_PER_TASK;
+	int last = MIN(batch->rolls, first + DISTRIBUTION_ROLLS_PER_TASK);
+	RollResult result;
+	for (int i = first; i < last; i++) {
+		LootRoll random(batch->seed, i);
+		snapshot->roll(random, result);
+		if (result.item == nullptr || result.count <= 0) {
+			continue;
+		}
+		if (result.is_entry_output()) {
+			for (uint32_t j = 0; j < result.entry_outputs.size(); j++) {
+				const StringName &id = result.entry_outputs[j].id;
+				// An id output more than once in a roll still only counts as one hit.
+				bool repeated = false;
+				for (uint32_t k = 0; k < j && !repeated; k++) {
+					repeated = result.entry_outputs[k].id == id;
+				}
+				if (!repeated) {
+					sample.entry_hits[id] = (sample.entry_hits.has(id) ? sample.entry_hits[id] : 0) + 1;
+				}
+				sample.entry_counts[id] = (sample.entry_counts.has(id) ? sample.entry_counts[id] : 0) + result.entry_outputs[j].count;
+			}
+		} else {
+			uint32_t item = result.item - snapshot->program_items.ptr();
+			sample.hits[item]++;
+			sample.counts[item] += result.count;
+		}
+	}
+}
+
+// Returns a dictionary with "items", which holds the "probability" of each id coming out of a roll and its
+// "expected_count" per roll, and "exact". Tables with entries the compiler does not know, such as scripted ones,
+// are estimated from monte_carlo_rolls rolls spread over the WorkerThreadPool instead, with "exact" false. Results
+// are cached until the table changes.
+Dictionary LootTable::compute_distribution(int monte_carlo_rolls) {
+	ERR_FAIL_NULL_V_MSG(root, Dictionary(), "This loot table does not have a root!");
+	ERR_FAIL_COND_V_MSG(monte_carlo_rolls <= 0, Dictionary(), "Loot table distributions need a positive number of rolls!");
+	Ref<Program> snapshot = get_program();
+	MutexLock lock(distribution_mutex);
+	if (distribution_program == snapshot && (distribution_exact || distribution_rolls == monte_carlo_rolls)) {
+		return distribution;
+	}
+	HashMap<StringName, double> probabilities;
+	HashMap<StringName, double> expected_counts;
+	bool exact = true;
+	if (!snapshot->nodes.is_empty()) {
+		LocalVector<bool> analyzed;
+		LocalVector<LocalVector<double>> node_probabilities;
+		LocalVector<LocalVector<double>> node_expected;
+		analyzed.resize(snapshot->nodes.size());
+		node_probabilities.resize(snapshot->nodes.size());
+		node_expected.resize(snapshot->nodes.size());
+		for (uint32_t i = 0; i < snapshot->nodes.size(); i++) {
+			analyzed[i] = false;
+		}
+		exact = snapshot->analyze_node(0, analyzed, node_probabilities, node_expected);
+		if (exact) {
+			for (uint32_t i = 0; i < snapshot->program_items.size(); i++) {
+				if (node_probabilities[0][i] > 0.0) {
+					const StringName &id = snapshot->program_items[i].id;
+					probabilities[id] = (probabilities.has(id) ? probabilities[id] : 0.0) + node_probabilities[0][i];
+					expected_counts[id] = (expected_counts.has(id) ? expected_counts[id] : 0.0) + node_expected[0][i];
+				}
+			}
+		}
+	}
+	if (!exact) {
+		DistributionBatch batch;
+		batch.program = snapshot.ptr();
+		// A fixed seed, so the estimate only changes with the table.
+		batch.seed = seed;
+		batch.rolls = monte_carlo_rolls;
+		uint32_t tasks = (monte_carlo_rolls + DISTRIBUTION_ROLLS_PER_TASK - 1) / DISTRIBUTION_ROLLS_PER_TASK;
+		batch.samples.resize(tasks);
+		WorkerThreadPool::GroupID group = WorkerThreadPool::get_singleton()->add_native_group_task(&LootTable::sample_distribution, &batch, tasks, -1, true, SNAME("Sample loot table distribution"));
+		WorkerThreadPool::get_singleton()->wait_for_group_task_completion(group);
+		HashMap<StringName, int64_t> hits;
+		HashMap<StringName, int64_t> counts;
+		for (uint32_t i = 0; i < tasks; i++) {
+			const DistributionSample &sample = batch.samples[i];
+			for (uint32_t j = 0; j < snapshot->program_items.size(); j++) {
+				if (sample.hits[j] > 0) {
+					const StringName &id = snapshot->program_items[j].id;
+					hits[id] = (hits.has(id) ? hits[id] : 0) + sample.hits[j];
+					counts[id] = (counts.has(id) ? counts[id] : 0) + sample.counts[j];
+				}
+			}
+			for (const KeyValue<StringName, int64_t> &E : sample.entry_hits) {
+				hits[E.key] = (hits.has(E.key) ? hits[E.key] : 0) + E.value;
+				counts[E.key] = (counts.has(E.key) ? counts[E.key] : 0) + sample.entry_counts[E.key];
+			}
+		}
+		for (const KeyValue<StringName, int64_t> &E : hits) {
+			probabilities[E.key] = (double)E.value / monte_carlo_rolls;
+			expected_counts[E.key] = (double)counts[E.key] / monte_carlo_rolls;
+		}
+	}
+	Dictionary items;
+	for (const KeyValue<StringName, double> &E : probabilities) {
+		Dictionary item;
+		item["probability"] = E.value;
+		item["expected_count"] = expected_counts[E.key];
+		items[E.key] = item;
+	}
+	distribution = Dictionary();
+	distribution["exact"] = exact;
+	distribution["items"] = items;
+	distribution_program = snapshot;
+	distribution_exact = exact;
+	distribution_rolls = monte_carlo_rolls;
+	return distribution;
 }
 
 LootTable::LootTable() {
 	root = Ref<LootTableEntry>(nullptr);
+	seed = ((uint64_t)Math::rand() << 32) | Math::rand();
+	program_dirty = true;
+	program_registry_generation = 0;
+	distribution_exact = false;
+	distribution_rolls = 0;
+	on_root_changed_callable = create_custom_callable_function_pointer(this,
+#ifdef DEBUG_METHODS_ENABLED
+		"on_root_changed",
+#endif
+		&LootTable::on_root_changed);
 }
 
 LootTable::~LootTable() {
@@ -33,14 +653,47 @@ LootTable::~LootTable() {
 
 void LootTableEntry::_bind_methods() {
 	ClassDB::bind_method(D_METHOD("get_output"), &LootTableEntry::get_output);
+	ClassDB::bind_method(D_METHOD("get_outputs"), &LootTableEntry::get_outputs);
 	ClassDB::bind_method(D_METHOD("get_weight"), &LootTableEntry::get_weight);
 	ClassDB::bind_method(D_METHOD("set_weight", "weight"), &LootTableEntry::set_weight);
+	GDVIRTUAL_BIND(_get_output);
 	
 	ADD_PROPERTY(PropertyInfo(Variant::INT, "weight"), "set_weight", "get_weight");
 }
 
 Ref<Item> LootTableEntry::get_output() {
-	return Ref<Item>(memnew(Item));
+	LootRoll roll = LootRoll::unseeded();
+	return roll_output(roll);
+}
+
+// Scripted entries draw their own random numbers, since scripts can not use the roll.
+Ref<Item> LootTableEntry::roll_output(LootRoll &roll) {
+	Ref<Item> output;
+	if (GDVIRTUAL_CALL(_get_output, output)) {
+		return output;
+	}
+	return Item::get_empty();
+}
+
+TypedArray<Item> LootTableEntry::get_outputs() {
+	LootRoll roll = LootRoll::unseeded();
+	LocalVector<Ref<Item>> outputs;
+	roll_outputs(roll, outputs);
+	TypedArray<Item> output;
+	for (uint32_t i = 0; i < outputs.size(); i++) {
+		output.push_back(outputs[i]);
+	}
+	return output;
+}
+
+void LootTableEntry::roll_outputs(LootRoll &roll, LocalVector<Ref<Item>> &r_outputs) {
+	Ref<Item> output = roll_output(roll);
+	if (!Item::is_empty_or_null(output)) {
+		r_outputs.push_back(output);
+	}
+}
+
+void LootTableEntry::prepare_rolls(HashSet<LootTableEntry *> &r_prepared) {
 }
 
 int LootTableEntry::get_weight() {
@@ -49,12 +702,11 @@ int LootTableEntry::get_weight() {
 
 void LootTableEntry::set_weight(int weight) {
 	this->weight = weight;
+	emit_changed();
 }
 
 LootTableEntry::LootTableEntry() {
 	weight = 100;
-	rng = Ref<RandomNumberGenerator>(memnew(RandomNumberGenerator));
-	rng->randomize();
 }
 
 LootTableEntry::~LootTableEntry() {
@@ -104,55 +756,257 @@ bool LootTableEntryArray::_set(const StringName &p_property, const Variant &p_va
 	if (id.is_valid_int()) {
 		int idx = id.to_int();
 		if (idx < entries.size()) {
+			disconnect_entry(entries[idx]);
 			if (is_nil) {
 				entries.remove_at(idx);
 				notify_property_list_changed();
 			} else {
 				entries[idx] = p_value;
+				connect_entry(p_value);
 			}
 		} else {
 			if (!is_nil) {
 				entries.push_back(p_value);
+				connect_entry(p_value);
 				notify_property_list_changed();
 			}
 		}
+		on_entry_changed();
 		return true;
 	}
 	if (!is_nil) {
 		entries.push_back(p_value);
+		connect_entry(p_value);
 		notify_property_list_changed();
+		on_entry_changed();
 	}
 	return true;
 }
 
+// The same entry can be in the array more than once, so connections are reference counted.
+void LootTableEntryArray::connect_entry(const Variant &entry) {
+	LootTableEntry *loot_entry = Object::cast_to<LootTableEntry>(entry);
+	if (loot_entry != nullptr) {
+		loot_entry->connect("changed", on_entry_changed_callable, CONNECT_REFERENCE_COUNTED);
+	}
+}
 
-Ref<Item> LootTableEntryArray::get_output() {
-	ERR_FAIL_COND_V_MSG(entries.is_empty(), memnew(Item), "This array loot table entry doesn't have any entries!");
-	int max = 0;
-	for (int i = 0; i < entries.size(); i++) {
-		max += Object::cast_to<LootTableEntry>(entries[i])->get_weight();
+void LootTableEntryArray::disconnect_entry(const Variant &entry) {
+	LootTableEntry *loot_entry = Object::cast_to<LootTableEntry>(entry);
+	if (loot_entry != nullptr && loot_entry->is_connected("changed", on_entry_changed_callable)) {
+		loot_entry->disconnect("changed", on_entry_changed_callable);
 	}
-	int rand_num = rng->randi_range(0, max);
-	max = 0;
-	for (int i = 0; i < entries.size(); i++) {
-		Ref<LootTableEntry> output = Object::cast_to<LootTableEntry>(entries[i]);
-		max += output->get_weight();
-		if (rand_num < max) {
-			return output->get_output();
+}
+
+void LootTableEntryArray::on_entry_changed() {
+	alias_dirty = true;
+	emit_changed();
+}
+
+void LootTableEntryArray::update_alias_table() {
+	uint32_t count = entries.size();
+	alias_entries.resize(count);
+	alias_thresholds.resize(count);
+	aliases.resize(count);
+	LocalVector<uint64_t> weights;
+	weights.resize(count);
+	for (uint32_t i = 0; i < count; i++) {
+		alias_entries[i] = entries[i];
+		weights[i] = alias_entries[i].is_valid() ? MAX(0, alias_entries[i]->get_weight()) : 0;
+	}
+	total_weight = build_alias_table(weights.ptr(), count, alias_thresholds.ptr(), aliases.ptr());
+	alias_dirty = false;
+}
+
+// Index of a random entry picked by weight, or -1 if no entry has a positive weight.
+int LootTableEntryArray::pick_entry(LootRoll &roll) {
+	if (alias_dirty) {
+		update_alias_table();
+	}
+	if (total_weight == 0) {
+		return -1;
+	}
+	uint32_t column = roll.below(alias_entries.size());
+	if (roll.below(total_weight) < alias_thresholds[column]) {
+		return column;
+	}
+	return aliases[column];
+}
+
+
+Ref<Item> LootTableEntryArray::roll_output(LootRoll &roll) {
+	ERR_FAIL_COND_V_MSG(entries.is_empty(), Item::get_empty(), "This array loot table entry doesn't have any entries!");
+	int index = pick_entry(roll);
+	ERR_FAIL_COND_V_MSG(index < 0, Item::get_empty(), "This array loot table entry doesn't have any entries with a positive weight!");
+	return alias_entries[index]->roll_output(roll);
+}
+
+void LootTableEntryArray::roll_outputs(LootRoll &roll, LocalVector<Ref<Item>> &r_outputs) {
+	ERR_FAIL_COND_MSG(entries.is_empty(), "This array loot table entry doesn't have any entries!");
+	int index = pick_entry(roll);
+	ERR_FAIL_COND_MSG(index < 0, "This array loot table entry doesn't have any entries with a positive weight!");
+	alias_entries[index]->roll_outputs(roll, r_outputs);
+}
+
+void LootTableEntryArray::prepare_rolls(HashSet<LootTableEntry *> &r_prepared) {
+	if (r_prepared.has(this)) {
+		return;
+	}
+	r_prepared.insert(this);
+	if (alias_dirty) {
+		update_alias_table();
+	}
+	for (uint32_t i = 0; i < alias_entries.size(); i++) {
+		if (alias_entries[i].is_valid()) {
+			alias_entries[i]->prepare_rolls(r_prepared);
 		}
 	}
-	return Ref<Item>(Object::cast_to<LootTableEntry>(entries[entries.size() - 1])->get_output());
 }
 
 LootTableEntryArray::LootTableEntryArray() {
 	entries = TypedArray<LootTableEntry>();
 	weight = 100;
+	total_weight = 0;
+	alias_dirty = true;
+	on_entry_changed_callable = create_custom_callable_function_pointer(this,
+#ifdef DEBUG_METHODS_ENABLED
+		"on_entry_changed",
+#endif
+		&LootTableEntryArray::on_entry_changed);
 }
 
 LootTableEntryArray::~LootTableEntryArray() {
 
 }
 
+void LootTableEntryDistinct::_bind_methods() {
+	ClassDB::bind_method(D_METHOD("get_picks"), &LootTableEntryDistinct::get_picks);
+	ClassDB::bind_method(D_METHOD("set_picks", "picks"), &LootTableEntryDistinct::set_picks);
+
+	ADD_PROPERTY(PropertyInfo(Variant::INT, "picks"), "set_picks", "get_picks");
+}
+
+int LootTableEntryDistinct::get_picks() {
+	return picks;
+}
+
+void LootTableEntryDistinct::set_picks(int picks) {
+	this->picks = MAX(1, picks);
+	emit_changed();
+}
+
+void LootTableEntryDistinct::on_entry_changed() {
+	tree_dirty = true;
+	LootTableEntryArray::on_entry_changed();
+}
+
+void LootTableEntryDistinct::update_tree() {
+	int count = entries.size();
+	tree_entries.resize(count);
+	tree_weights.resize(count);
+	tree.resize(count + 1);
+	tree[0] = 0;
+	tree_total = 0;
+	tree_available = 0;
+	for (int i = 0; i < count; i++) {
+		tree_entries[i] = entries[i];
+		tree_weights[i] = tree_entries[i].is_valid() ? MAX(0, tree_entries[i]->get_weight()) : 0;
+		tree[i + 1] = tree_weights[i];
+		tree_total += tree_weights[i];
+		if (tree_weights[i] > 0) {
+			tree_available++;
+		}
+	}
+	// Each node adds itself to its parent, which builds the tree in O(n).
+	for (int i = 1; i <= count; i++) {
+		int parent = i + (i & -i);
+		if (parent <= count) {
+			tree[parent] += tree[i];
+		}
+	}
+	tree_step = 1;
+	while (tree_step * 2 <= count) {
+		tree_step *= 2;
+	}
+	tree_dirty = false;
+}
+
+// Only the first pick, for callers that take a single item.
+Ref<Item> LootTableEntryDistinct::roll_output(LootRoll &roll) {
+	LocalVector<Ref<Item>> outputs;
+	roll_outputs(roll, outputs);
+	if (outputs.is_empty()) {
+		return Item::get_empty();
+	}
+	return outputs[0];
+}
+
+void LootTableEntryDistinct::roll_outputs(LootRoll &roll, LocalVector<Ref<Item>> &r_outputs) {
+	ERR_FAIL_COND_MSG(entries.is_empty(), "This distinct loot table entry doesn't have any entries!");
+	if (tree_dirty) {
+		update_tree();
+	}
+	int count = MIN(picks, tree_available);
+	ERR_FAIL_COND_MSG(count == 0, "This distinct loot table entry doesn't have any entries with a positive weight!");
+	int size = tree_entries.size();
+	uint64_t total = tree_total;
+	// Weight taken out of each node by the entries already picked in this roll, so the tree itself is left alone.
+	HashMap<int, uint64_t> picked_weights;
+	for (int i = 0; i < count; i++) {
+		// Finds the entry whose share of the weight the draw falls in, skipping whole subtrees that end before it.
+		uint64_t draw = roll.below(total);
+		int picked = 0;
+		for (int step = tree_step; step > 0; step /= 2) {
+			int node = picked + step;
+			if (node > size) {
+				continue;
+			}
+			uint64_t node_weight = tree[node];
+			const uint64_t *removed = picked_weights.getptr(node);
+			if (removed != nullptr) {
+				node_weight -= *removed;
+			}
+			if (node_weight <= draw) {
+				picked = node;
+				draw -= node_weight;
+			}
+		}
+		// Only the O(log n) nodes covering the picked entry lose its weight.
+		for (int node = picked + 1; node <= size; node += node & -node) {
+			picked_weights[node] += tree_weights[picked];
+		}
+		total -= tree_weights[picked];
+		tree_entries[picked]->roll_outputs(roll, r_outputs);
+	}
+}
+
+void LootTableEntryDistinct::prepare_rolls(HashSet<LootTableEntry *> &r_prepared) {
+	if (r_prepared.has(this)) {
+		return;
+	}
+	r_prepared.insert(this);
+	if (tree_dirty) {
+		update_tree();
+	}
+	for (uint32_t i = 0; i < tree_entries.size(); i++) {
+		if (tree_entries[i].is_valid()) {
+			tree_entries[i]->prepare_rolls(r_prepared);
+		}
+	}
+}
+
+LootTableEntryDistinct::LootTableEntryDistinct() {
+	picks = 1;
+	tree_total = 0;
+	tree_available = 0;
+	tree_step = 1;
+	tree_dirty = true;
+}
+
+LootTableEntryDistinct::~LootTableEntryDistinct() {
+
+}
+
 void LootTableEntryConstant::_bind_methods() {
 	ClassDB::bind_method(D_METHOD("set_output", "output"), &LootTableEntryConstant::set_output);
 	ClassDB::bind_method(D_METHOD("editor_get_output"), &LootTableEntryConstant::editor_get_output);
@@ -162,13 +1016,14 @@ void LootTableEntryConstant::_bind_methods() {
 
 void LootTableEntryConstant::set_output(Ref<Item> output) {
 	this->output = output;
+	emit_changed();
 }
 
-Ref<Item> LootTableEntryConstant::get_output() {
-	if (output.is_valid()) {
-		return output->clone();
+Ref<Item> LootTableEntryConstant::roll_output(LootRoll &roll) {
+	if (Item::is_empty_or_null(output)) {
+		return Item::get_empty();
 	} else {
-		return output;
+		return output->clone();
 	}
 }
 
@@ -203,6 +1058,7 @@ int LootTableEntryRandomize::get_min() {
 
 void LootTableEntryRandomize::set_min(int min) {
 	this->min = MAX(1, min);
+	emit_changed();
 }
 
 int LootTableEntryRandomize::get_max() {
@@ -211,6 +1067,7 @@ int LootTableEntryRandomize::get_max() {
 
 void LootTableEntryRandomize::set_max(int max) {
 	this->max = MAX(min, max);
+	emit_changed();
 }
 
 Ref<LootTableEntry> LootTableEntryRandomize::get_entry() {
@@ -218,23 +1075,58 @@ Ref<LootTableEntry> LootTableEntryRandomize::get_entry() {
 }
 
 void LootTableEntryRandomize::set_entry(Ref<LootTableEntry> entry) {
+	if (this->entry.is_valid() && this->entry->is_connected("changed", on_entry_changed_callable)) {
+		this->entry->disconnect("changed", on_entry_changed_callable);
+	}
 	this->entry = entry;
+	if (entry.is_valid()) {
+		entry->connect("changed", on_entry_changed_callable);
+	}
+	emit_changed();
 }
 
-Ref<Item> LootTableEntryRandomize::get_output() {
-	ERR_FAIL_NULL_V_MSG(entry, memnew(Item), "This loot table entry randomizer doesn't have a loot table entry to randomize!");
+void LootTableEntryRandomize::on_entry_changed() {
+	emit_changed();
+}
+
+Ref<Item> LootTableEntryRandomize::roll_output(LootRoll &roll) {
+	ERR_FAIL_NULL_V_MSG(entry, Item::get_empty(), "This loot table entry randomizer doesn't have a loot table entry to randomize!");
 
-	Ref<Item> output = entry->get_output();
-	if (!output->is_empty()) {
-		output->set_count(rng->randi_range(MAX(1, min), MIN(output->get_data()->get_stack_size(), max)));
+	Ref<Item> output = entry->roll_output(roll);
+	if (!Item::is_empty_or_null(output)) {
+		output->set_count(roll.range(MAX(1, min), MIN(output->get_data()->get_stack_size(), max)));
 	}
 	return output;
 }
 
+void LootTableEntryRandomize::roll_outputs(LootRoll &roll, LocalVector<Ref<Item>> &r_outputs) {
+	ERR_FAIL_NULL_MSG(entry, "This loot table entry randomizer doesn't have a loot table entry to randomize!");
+	uint32_t first = r_outputs.size();
+	entry->roll_outputs(roll, r_outputs);
+	for (uint32_t i = first; i < r_outputs.size(); i++) {
+		r_outputs[i]->set_count(roll.range(MAX(1, min), MIN(r_outputs[i]->get_data()->get_stack_size(), max)));
+	}
+}
+
+void LootTableEntryRandomize::prepare_rolls(HashSet<LootTableEntry *> &r_prepared) {
+	if (r_prepared.has(this)) {
+		return;
+	}
+	r_prepared.insert(this);
+	if (entry.is_valid()) {
+		entry->prepare_rolls(r_prepared);
+	}
+}
+
 LootTableEntryRandomize::LootTableEntryRandomize() {
 	entry = Ref<LootTableEntry>(nullptr);
 	min = 1;
 	max = 100;
+	on_entry_changed_callable = create_custom_callable_function_pointer(this,
+#ifdef DEBUG_METHODS_ENABLED
+		"on_entry_changed",
+#endif
+		&LootTableEntryRandomize::on_entry_changed);
 }
 
 LootTableEntryRandomize::~LootTableEntryRandomize() {
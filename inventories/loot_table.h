@@ -1,50 +1,83 @@
 #ifndef LOOT_TABLE_H
 #define LOOT_TABLE_H
 
-#include "core/math/random_number_generator.h"
 #include "core/object/ref_counted.h"
+#include "core/os/mutex.h"
+#include "core/templates/safe_refcount.h"
 #include "core/variant/typed_array.h"
 #include "core/string/ustring.h"
 #include "core/string/string_name.h"
 #include "core/io/resource.h"
+#include "core/object/callable_method_pointer.h"
+#include "core/templates/local_vector.h"
+#include "core/templates/hash_map.h"
+#include "core/templates/hash_set.h"
 
 #include "item.h"
 
+class Inventory;
+
+// The random numbers of a single roll, a counter-based generator whose every number is a pure function of the
+// seed, the roll index and how many numbers the roll drew before. It holds no shared state, so rolls can run on
+// any thread and reproduce anywhere given the same seed and index.
+struct LootRoll {
+	uint64_t key;
+	uint64_t counter = 0;
+	static uint64_t mix(uint64_t value);
+	uint64_t next();
+	uint64_t below(uint64_t bound);
+	int range(int from, int to);
+	// A roll with a seed from the global random number generator, for rolls that do not need to be reproduced.
+	static LootRoll unseeded();
+	LootRoll(uint64_t seed, uint64_t roll_index);
+};
+
 class LootTableEntry : public Resource {
 	GDCLASS(LootTableEntry, Resource);
 	OBJ_SAVE_TYPE(LootTableEntry);
 protected:
 	static void _bind_methods();
 	int weight;
-	Ref<RandomNumberGenerator> rng;
 public:
 	void set_weight(int weight);
 	int get_weight();
-	virtual Ref<Item> get_output();
+	Ref<Item> get_output();
+	TypedArray<Item> get_outputs();
+	virtual Ref<Item> roll_output(LootRoll &roll);
+	// Appends every non-empty item the entry outputs, for entries that can output more than one.
+	virtual void roll_outputs(LootRoll &roll, LocalVector<Ref<Item>> &r_outputs);
+	// Builds the lazily built tables of the entry and the entries inside it, so rolls only read them and can run
+	// on several threads at once.
+	virtual void prepare_rolls(HashSet<LootTableEntry *> &r_prepared);
+	GDVIRTUAL0R(Ref<Item>, _get_output);
 	LootTableEntry();
 	~LootTableEntry();
 };
 
 class LootTableEntryConstant : public LootTableEntry {
 	GDCLASS(LootTableEntryConstant, LootTableEntry);
+	friend class LootTable;
 protected:
 	static void _bind_methods();
 	Ref<Item> output;
 public:
 	void set_output(Ref<Item> output);
 	Ref<Item> editor_get_output();
-    Ref<Item> get_output() override;
+    Ref<Item> roll_output(LootRoll &roll) override;
 	LootTableEntryConstant();
 	~LootTableEntryConstant();
 };
 
 class LootTableEntryRandomize : public LootTableEntry {
 	GDCLASS(LootTableEntryRandomize, LootTableEntry);
+	friend class LootTable;
 protected:
 	static void _bind_methods();
 	int min;
 	int max;
 	Ref<LootTableEntry> entry;
+	Callable on_entry_changed_callable;
+	void on_entry_changed();
 public:
     Ref<LootTableEntry> get_entry();
     void set_entry(Ref<LootTableEntry> entry);
@@ -52,25 +85,72 @@ public:
 	void set_min(int min);
 	int get_max();
 	void set_max(int max);
-    Ref<Item> get_output() override;
+    Ref<Item> roll_output(LootRoll &roll) override;
+	void roll_outputs(LootRoll &roll, LocalVector<Ref<Item>> &r_outputs) override;
+	void prepare_rolls(HashSet<LootTableEntry *> &r_prepared) override;
 	LootTableEntryRandomize();
 	~LootTableEntryRandomize();
 };
 
 class LootTableEntryArray : public LootTableEntry {
 	GDCLASS(LootTableEntryArray, LootTableEntry);
+	friend class LootTable;
 protected:
 	static void _bind_methods();
 	TypedArray<LootTableEntry> entries;
+	// Vose alias table over the entry weights, rebuilt on the next roll after the entries or their weights change.
+	LocalVector<Ref<LootTableEntry>> alias_entries;
+	LocalVector<uint64_t> alias_thresholds;
+	LocalVector<uint32_t> aliases;
+	uint64_t total_weight;
+	bool alias_dirty;
+	void update_alias_table();
+	int pick_entry(LootRoll &roll);
+	Callable on_entry_changed_callable;
+	virtual void on_entry_changed();
+	void connect_entry(const Variant &entry);
+	void disconnect_entry(const Variant &entry);
 public:
     void _get_property_list(List<PropertyInfo> *r_props) const;
     bool _get(const StringName &p_property, Variant &r_value) const;
     bool _set(const StringName &p_property, const Variant &p_value);
-    Ref<Item> get_output() override;
+    Ref<Item> roll_output(LootRoll &roll) override;
+	void roll_outputs(LootRoll &roll, LocalVector<Ref<Item>> &r_outputs) override;
+	void prepare_rolls(HashSet<LootTableEntry *> &r_prepared) override;
 	LootTableEntryArray();
 	~LootTableEntryArray();
 };
 
+// Picks up to picks different entries by weight, without replacement.
+class LootTableEntryDistinct : public LootTableEntryArray {
+	GDCLASS(LootTableEntryDistinct, LootTableEntryArray);
+	friend class LootTable;
+protected:
+	static void _bind_methods();
+	int picks;
+	// Fenwick tree over the entry weights, rebuilt on the next roll after the entries or their weights change. Each
+	// pick walks down it in O(log n), taking the weights of entries already picked in the roll out of a per-roll
+	// overlay of the nodes covering them, so the tree itself is only read and several threads can roll the same entry
+	// at once.
+	LocalVector<Ref<LootTableEntry>> tree_entries;
+	LocalVector<uint64_t> tree_weights;
+	LocalVector<uint64_t> tree;
+	uint64_t tree_total;
+	int tree_available;
+	int tree_step;
+	bool tree_dirty;
+	void update_tree();
+	void on_entry_changed() override;
+public:
+	int get_picks();
+	void set_picks(int picks);
+	Ref<Item> roll_output(LootRoll &roll) override;
+	void roll_outputs(LootRoll &roll, LocalVector<Ref<Item>> &r_outputs) override;
+	void prepare_rolls(HashSet<LootTableEntry *> &r_prepared) override;
+	LootTableEntryDistinct();
+	~LootTableEntryDistinct();
+};
+
 class LootTable : public Resource {
 	GDCLASS(LootTable, Resource);
 	RES_BASE_EXTENSION("loot");
@@ -78,12 +158,111 @@ class LootTable : public Resource {
 protected:
 	static void _bind_methods();
 	Ref<LootTableEntry> root;
-	Ref<RandomNumberGenerator> rng;
+	// Seed and roll index for rolls without a seed of their own.
+	uint64_t seed;
+	SafeNumeric<uint64_t> roll_count;
+
+	// The entry tree compiled into flat arrays, rebuilt on the next roll after the tree or the item registry
+	// changes. Entries used in several places are compiled once. Rolling walks down from node 0 without creating
+	// anything until the final Item.
+	enum ProgramNodeType {
+		NODE_EMPTY,
+		// first is the index of the item.
+		NODE_ITEM,
+		// Picks one of count alias table columns starting at first, out of total_weight. Both come from a single draw
+		// below range, the product of the two, unless that does not fit in 64 bits and range is 0.
+		NODE_PICK,
+		// Sets the count of the item from node first to between min and max, within its stack size.
+		NODE_RANDOMIZE,
+		// Calls roll_output() on the entry first, for entries the compiler does not know, such as scripted ones.
+		NODE_ENTRY,
+	};
+	struct ProgramNode {
+		ProgramNodeType type = NODE_EMPTY;
+		uint32_t first = 0;
+		uint32_t count = 0;
+		int min = 0;
+		int max = 0;
+		uint64_t total_weight = 0;
+		uint64_t range = 0;
+	};
+	struct ProgramColumn {
+		uint64_t threshold = 0;
+		uint32_t node = 0;
+		uint32_t alias_node = 0;
+	};
+	// Constant outputs with their registry data resolved when compiling.
+	struct ProgramItem {
+		StringName id;
+		int count = 0;
+		int stack_size = 0;
+		uint32_t type = 0;
+	};
+	struct RollResult {
+		const ProgramItem *item = nullptr;
+		int count = 0;
+		// Holds the outputs of a NODE_ENTRY, and item then points to the first. Entries can output several items,
+		// such as distinct picks, and the counts of all of them are kept here.
+		LocalVector<ProgramItem> entry_outputs;
+		LocalVector<Ref<Item>> entry_items;
+		bool is_entry_output() const { return item != nullptr && item == entry_outputs.ptr(); }
+	};
+	// A compiled program is never changed, so any number of threads can roll it. Compiling again publishes a new
+	// one, and rolls keep the one they started with until they finish.
+	class Program : public RefCounted {
+	public:
+		LocalVector<ProgramNode> nodes;
+		LocalVector<ProgramColumn> columns;
+		LocalVector<ProgramItem> program_items;
+		LocalVector<Ref<LootTableEntry>> program_entries;
+		uint32_t add_node(ProgramNodeType type);
+		void roll(LootRoll &random, RollResult &r_result) const;
+		bool analyze_node(uint32_t index, LocalVector<bool> &analyzed, LocalVector<LocalVector<double>> &probabilities, LocalVector<LocalVector<double>> &expected) const;
+	};
+	Ref<Program> program;
+	bool program_dirty;
+	uint64_t program_registry_generation;
+	// Guards publishing the program, not rolling it.
+	Mutex program_mutex;
+	void compile();
+	uint32_t compile_entry(Program &r_program, const Ref<LootTableEntry> &entry, HashMap<const LootTableEntry *, uint32_t> &compiled, HashSet<const LootTableEntry *> &visiting);
+	Ref<Program> get_program();
+	void roll_totals(int rolls, HashMap<StringName, int64_t> &r_totals);
+	static Dictionary pack_totals(const HashMap<StringName, int64_t> &totals);
+
+	// Cached result of compute_distribution, for the program it was computed from.
+	Dictionary distribution;
+	Ref<Program> distribution_program;
+	bool distribution_exact;
+	int distribution_rolls;
+	Mutex distribution_mutex;
+	struct DistributionSample {
+		LocalVector<int64_t> hits;
+		LocalVector<int64_t> counts;
+		HashMap<StringName, int64_t> entry_hits;
+		HashMap<StringName, int64_t> entry_counts;
+	};
+	struct DistributionBatch {
+		const Program *program = nullptr;
+		uint64_t seed = 0;
+		int rolls = 0;
+		LocalVector<DistributionSample> samples;
+	};
+	static constexpr int DISTRIBUTION_ROLLS_PER_TASK = 4096;
+	static void sample_distribution(void *p_batch, uint32_t p_index);
+	Callable on_root_changed_callable;
+	void on_root_changed();
 
 public:
 	void set_root(Ref<LootTableEntry> input);
 	Ref<LootTableEntry> get_root();
 	Ref<Item> get_output();
+	Ref<Item> get_output_seeded(int64_t seed, int64_t roll_index);
+	TypedArray<Item> get_outputs();
+	TypedArray<Item> get_outputs_seeded(int64_t seed, int64_t roll_index);
+	Dictionary roll_batch(int rolls);
+	Dictionary roll_into(Ref<Inventory> inventory, int rolls);
+	Dictionary compute_distribution(int monte_carlo_rolls = 1000000);
 
 	LootTable();
 	~LootTable();
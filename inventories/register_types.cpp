@@ -14,6 +14,7 @@ void initialize_inventories_module(ModuleInitializationLevel p_level) {
 	}
 
 	ClassDB::register_class<Item>();
+	Item::register_hook();
 	ClassDB::register_class<ItemData>();
 	ClassDB::register_class<ItemRegistry>();
 	item_registry = new ItemRegistry();
@@ -24,6 +25,7 @@ void initialize_inventories_module(ModuleInitializationLevel p_level) {
 	ClassDB::register_class<LootTableEntryArray>();
 	ClassDB::register_class<LootTableEntryConstant>();
 	ClassDB::register_class<LootTableEntryRandomize>();
+	ClassDB::register_class<LootTableEntryDistinct>();
 	
 	ClassDB::register_class<Inventory>();
 
@@ -34,6 +36,7 @@ void initialize_inventories_module(ModuleInitializationLevel p_level) {
 	ClassDB::register_class<SlotHelper>();
 
 	ClassDB::register_class<CraftingRecipe>();
+	ClassDB::register_class<ShapedCraftingRecipe>();
 }
 
 void uninitialize_inventories_module(ModuleInitializationLevel p_level) {
@@ -43,4 +46,5 @@ void uninitialize_inventories_module(ModuleInitializationLevel p_level) {
 	Engine::get_singleton()->remove_singleton("ItemRegistry");
 	delete item_registry;
 	CraftingRecipe::unregister_hook();
+	Item::unregister_hook();
 }
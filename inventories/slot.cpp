@@ -39,7 +39,7 @@ Ref<Item> AbstractSlot::take_item() {
         return output;
     } else {
         output = peek_item();
-        set_item(memnew(Item));
+        set_item(Item::get_empty());
         return output;
     }
 }
@@ -53,7 +53,7 @@ Ref<Item> AbstractSlot::swap_item(Ref<Item> other) {
     } else {
         if (Item::is_empty_or_null(output)) {
             if (set_item(other)) {
-                return memnew(Item);
+                return Item::get_empty();
             } else {
                 return other;
             }
@@ -364,7 +364,11 @@ void InventorySlot::set_inventory(Ref<Inventory> inventory) {
     if (this->inventory.is_valid() && this->inventory->is_connected("item_changed", on_item_change_callable)) {
         this->inventory->disconnect("item_changed", on_item_change_callable);
     }
+    if (this->inventory.is_valid() && this->inventory->is_connected("items_changed", on_items_change_callable)) {
+        this->inventory->disconnect("items_changed", on_items_change_callable);
+    }
     inventory->connect("item_changed", on_item_change_callable);
+    inventory->connect("items_changed", on_items_change_callable);
     this->inventory = inventory;
     if (mouse_hovering) {
         SlotHelper *helper = get_default_slot_helper();
@@ -428,8 +432,8 @@ Ref<Item> InventorySlot::swap_item(Ref<Item> other) {
         queue_redraw();
         return output;
     } else if (other->get_id() == inventory->peek_slot(slot_id)->get_id()) {
-        int remainder = inventory->add_slot(slot_id, other->clone());
-        other->set_count(remainder);
+        // Merging into a stack of the same id leaves the remainder in other.
+        inventory->add_slot(slot_id, other);
         queue_redraw();
         return other;
     } else {
@@ -451,12 +455,25 @@ void InventorySlot::on_item_change(int slot_id, Ref<Item> new_item) {
     }
 }
 
+void InventorySlot::on_items_change(PackedInt32Array slot_ids) {
+    // Batched slot ids are sorted.
+    int idx = slot_ids.bsearch(slot_id, true);
+    if (idx < slot_ids.size() && slot_ids[idx] == slot_id) {
+        on_item_change(slot_id, peek_item());
+    }
+}
+
 InventorySlot::InventorySlot() {
     on_item_change_callable = create_custom_callable_function_pointer(this,
 #ifdef DEBUG_METHODS_ENABLED
         "on_item_change",
 #endif
         &InventorySlot::on_item_change);
+    on_items_change_callable = create_custom_callable_function_pointer(this,
+#ifdef DEBUG_METHODS_ENABLED
+        "on_items_change",
+#endif
+        &InventorySlot::on_items_change);
     inventory = Ref<Inventory>(nullptr);
     slot_id = 0;
 }
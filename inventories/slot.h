@@ -118,6 +118,8 @@ protected:
     // Item change event handler
     Callable on_item_change_callable;
     void on_item_change(int slot_id, Ref<Item> new_item);
+    Callable on_items_change_callable;
+    void on_items_change(PackedInt32Array slot_ids);
 
 public:
     Ref<Item> peek_item() override;